@@ -57,8 +57,28 @@
 typedef enum {
     CSFM_ERROR_SUCCESS,
     CSFM_ERROR_OUT_OF_MEMORY,
+    CSFM_ERROR_INVALID_UTF8,
+    // Reading the input failed part way, see CSFM_Pipeline_parse.
+    CSFM_ERROR_IO,
 } CSFM_ErrorType;
 
+typedef enum {
+    CSFM_OPTION_NONE = 0,
+    // Validate that TEXT and marker spans are well-formed UTF-8 while they
+    // are scanned. The first invalid byte is reported through the result.
+    CSFM_OPTION_VALIDATE_UTF8 = 1 << 0,
+    // Build per-marker posting lists (see CSFM_PostingLists) in the same pass.
+    CSFM_OPTION_POSTING_LISTS = 1 << 1,
+    // Parse `|key="value"` lists after milestones and the character markers
+    // that take them (\w, \rb, \fig, \jmp) into CSFM_ParseResult.attributes
+    // instead of leaving them in TEXT nodes.
+    CSFM_OPTION_ATTRIBUTES = 1 << 2,
+} CSFM_OptionFlags;
+
+typedef struct {
+    uint32_t flags;
+} CSFM_Options;
+
 typedef struct {
     uint8_t *ptr;
     uint32_t length;
@@ -66,6 +86,71 @@ typedef struct {
 
 static inline char CSFM_String8Slice_get(CSFM_String8Slice slice, uint32_t idx);
 
+// Returns the index of the first byte that is not part of a well-formed
+// UTF-8 sequence, or `length` if the whole buffer is valid.
+uint32_t CSFM_UTF8_findInvalid(const uint8_t *ptr, uint32_t length);
+
+typedef enum {
+    CSFM_ENCODING_UTF8,
+    CSFM_ENCODING_UTF16LE,
+    CSFM_ENCODING_UTF16BE,
+    CSFM_ENCODING_LATIN1,
+    CSFM_ENCODING_CP1252,
+} CSFM_Encoding;
+
+// Sniffs the encoding from a byte order mark, a BOM-less UTF-16 `\id`, or the
+// `\ide` line. Falls back to UTF-8. `bomLength` may be NULL.
+CSFM_Encoding CSFM_Encoding_detect(const uint8_t *buf, uint32_t size, uint32_t *bomLength);
+
+// Sparse (output offset, input offset) checkpoints, roughly one every
+// CSFM_OFFSET_MAP_STRIDE output bytes. Anything in between is recovered by
+// decoding forward from the nearest checkpoint.
+#define CSFM_OFFSET_MAP_STRIDE 4096
+
+typedef struct {
+    uint32_t output;
+    uint32_t input;
+} CSFM_OffsetCheckpoint;
+
+typedef struct {
+    CSFM_OffsetCheckpoint *buffer;
+    uint32_t length;
+    uint32_t capacity;
+} CSFM_OffsetMap;
+
+void CSFM_OffsetMap_deallocate(CSFM_OffsetMap *map);
+// `input` is the original (untranscoded) buffer the map was built from.
+uint32_t CSFM_OffsetMap_originalOffset(
+    CSFM_OffsetMap *map, CSFM_Encoding encoding,
+    const uint8_t *input, uint32_t inputLength, uint32_t outputOffset
+);
+
+typedef struct {
+    CSFM_Encoding encoding;
+    // NOTE(mattg): Running totals across every `feed` call.
+    uint32_t input_offset;
+    uint32_t output_offset;
+    // Optional, records checkpoints as blocks go through.
+    CSFM_OffsetMap *map;
+} CSFM_Transcoder;
+
+void CSFM_Transcoder_init(CSFM_Transcoder *transcoder, CSFM_Encoding encoding, CSFM_OffsetMap *map);
+// Transcodes one block to UTF-8. Stops early when `out` is full or when the
+// block ends inside a character, returns the number of input bytes consumed.
+// Unconsumed bytes must be passed again at the front of the next block.
+uint32_t CSFM_Transcoder_feed(
+    CSFM_Transcoder *transcoder,
+    const uint8_t *in, uint32_t inLength,
+    uint8_t *out, uint32_t outCapacity, uint32_t *produced
+);
+
+// Whole-buffer convenience: strips the BOM and transcodes into a freshly
+// allocated buffer the caller frees. `map` may be NULL.
+CSFM_ErrorType CSFM_TranscodeToUTF8(
+    const uint8_t *buf, uint32_t size, CSFM_Encoding encoding,
+    CSFM_String8Slice *out, CSFM_OffsetMap *map
+);
+
 typedef enum {
     CSFM_TOKEN_NULL,
     CSFM_TOKEN_WS,
@@ -94,27 +179,49 @@ typedef struct {
     CSFM_TokenType type;
 } CSFM_Token;
 
+// NOTE(mattg): Token and node arrays are segmented. Elements live in fixed
+// size, cache line aligned blocks of CSFM_ARRAY_BLOCK_LENGTH, `blocks` is the
+// directory. Growing adds a block (and every so often doubles the directory,
+// which is tiny), nothing already pushed is ever copied or moved, so there is
+// no realloc spike and pointers into the array stay valid while it grows.
+#define CSFM_ARRAY_BLOCK_SHIFT 10
+#define CSFM_ARRAY_BLOCK_LENGTH (1u << CSFM_ARRAY_BLOCK_SHIFT)
+#define CSFM_ARRAY_BLOCK_MASK (CSFM_ARRAY_BLOCK_LENGTH - 1)
+#define CSFM_CACHE_LINE 64
+
 typedef struct {
-    CSFM_Token *buffer;
+    CSFM_Token **blocks;
+    uint32_t block_count;
+    uint32_t directory_capacity;
     uint32_t length;
+    // Always block_count * CSFM_ARRAY_BLOCK_LENGTH.
     uint32_t capacity;
 } CSFM_TokenArray;
 
 #define CSFM_TOKEN_ARRAY_CAPACITY_MAX UINT32_MAX / sizeof(CSFM_Token)
 
+// NOTE(mattg): `capacity` only sizes the directory, blocks are allocated as
+// pushes reach them.
 CSFM_ErrorType CSFM_TokenArray_allocate(CSFM_TokenArray *array, uint32_t capacity);
 void CSFM_TokenArray_deallocate(CSFM_TokenArray *array);
 void CSFM_TokenArray_reuse(CSFM_TokenArray *array);
 static CSFM_ErrorType CSFM_TokenArray_resize(CSFM_TokenArray *array, uint32_t newCapacity);
 static CSFM_ErrorType CSFM_TokenArray_push(CSFM_TokenArray *array, CSFM_Token token);
 CSFM_Token CSFM_TokenArray_get(CSFM_TokenArray array, uint32_t index);
+// Copies the tokens into one contiguous buffer the caller frees, for code
+// that needs a plain `CSFM_Token *`. `*out` is NULL for an empty array.
+CSFM_ErrorType CSFM_TokenArray_export(const CSFM_TokenArray *array, CSFM_Token **out);
 
 typedef struct {
     CSFM_String8Slice input;
     CSFM_TokenArray tokens;
+    CSFM_ErrorType error;
+    // NOTE(mattg): Only meaningful when `error` is CSFM_ERROR_INVALID_UTF8.
+    uint32_t error_offset;
 } CSFM_TokenResult;
 
 CSFM_TokenResult CSFM_TokenizeAll(uint8_t *buf, uint32_t size);
+CSFM_TokenResult CSFM_TokenizeAllWithOptions(uint8_t *buf, uint32_t size, CSFM_Options options);
 
 typedef enum {
     CSFM_MARKER_id,
@@ -260,14 +367,35 @@ typedef enum {
     CSFM_MARKER_esbe,
     CSFM_MARKER_cat,
     CSFM_MARKER_periph,
+    CSFM_MARKER_UNKNOWN,
+    CSFM_MARKER_COUNT,
 } CSFM_Marker;
 
+typedef enum {
+    CSFM_MARKER_KIND_UNKNOWN,
+    CSFM_MARKER_KIND_HEADER,
+    CSFM_MARKER_KIND_PARAGRAPH,
+    CSFM_MARKER_KIND_CHAPTER,
+    CSFM_MARKER_KIND_VERSE,
+    CSFM_MARKER_KIND_NOTE,
+    CSFM_MARKER_KIND_NOTE_CHARACTER,
+    CSFM_MARKER_KIND_CHARACTER,
+    CSFM_MARKER_KIND_MILESTONE,
+} CSFM_MarkerKind;
+
+// `name` is the marker text without the backslash, number or `-s`/`-e`.
+CSFM_Marker CSFM_Marker_fromName(const uint8_t *name, uint32_t length);
+const char *CSFM_Marker_name(CSFM_Marker marker);
+CSFM_MarkerKind CSFM_Marker_kind(CSFM_Marker marker);
+
 typedef enum {
     CSFM_NODE_NULL,
     CSFM_NODE_MARKER,
     CSFM_NODE_TEXT,
     CSFM_NODE_WHITESPACE,
     CSFM_NODE_NEWLINE,
+    // `|...` up to the closing marker, see CSFM_OPTION_ATTRIBUTES.
+    CSFM_NODE_ATTRIBUTES,
 } CSFM_NodeType;
 
 typedef enum {
@@ -288,10 +416,18 @@ typedef struct {
     CSFM_MarkerType marker_type;
     uint32_t marker_text_start;
     uint32_t marker_text_end;
+    CSFM_Marker marker;
+    // Set on the owning marker node and on the ATTRIBUTES node itself:
+    // attributes.buffer[attribute_index .. attribute_index + attribute_count).
+    uint32_t attribute_index;
+    uint32_t attribute_count;
 } CSFM_Node;
 
+// Segmented like CSFM_TokenArray.
 typedef struct {
-    CSFM_Node *buffer;
+    CSFM_Node **blocks;
+    uint32_t block_count;
+    uint32_t directory_capacity;
     uint32_t length;
     uint32_t capacity;
 } CSFM_NodeArray;
@@ -305,19 +441,479 @@ static CSFM_ErrorType CSFM_NodeArray_resize(CSFM_NodeArray *array, uint32_t newC
 static CSFM_ErrorType CSFM_NodeArray_push(CSFM_NodeArray *array, CSFM_Node node);
 static void CSFM_NodeArray_pop(CSFM_NodeArray *array);
 CSFM_Node CSFM_NodeArray_get(CSFM_NodeArray array, uint32_t index);
+// In place access without the copy `_get` makes, `index` must be below
+// `length`. The pointer stays valid until the node is popped or the array
+// is reused.
+static inline CSFM_Node *CSFM_NodeArray_at(const CSFM_NodeArray *array, uint32_t index);
+CSFM_ErrorType CSFM_NodeArray_export(const CSFM_NodeArray *array, CSFM_Node **out);
+
+typedef struct {
+    uint32_t *buffer;
+    uint32_t length;
+    uint32_t capacity;
+} CSFM_IndexArray;
+
+void CSFM_IndexArray_deallocate(CSFM_IndexArray *array);
+
+typedef enum {
+    // `\` followed by something other than a marker name.
+    CSFM_DIAGNOSTIC_MISSING_MARKER_NAME,
+    // `\+` followed by something other than a marker name.
+    CSFM_DIAGNOSTIC_MISSING_NESTED_MARKER_NAME,
+    // A closing marker with no open marker of the same name.
+    CSFM_DIAGNOSTIC_UNMATCHED_CLOSE_MARKER,
+    // An attribute list that is not `key="value"` pairs or a lone default value.
+    CSFM_DIAGNOSTIC_MALFORMED_ATTRIBUTE,
+} CSFM_DiagnosticCode;
+
+typedef struct {
+    CSFM_DiagnosticCode code;
+    uint32_t offset;
+    uint32_t node_index;
+} CSFM_Diagnostic;
+
+// NOTE(mattg): Only allocated once the first diagnostic is reported, so clean
+// input never touches it. Defining CSFM_NO_DIAGNOSTICS compiles the reporting
+// out entirely, the array is then always empty.
+typedef struct {
+    CSFM_Diagnostic *buffer;
+    uint32_t length;
+    uint32_t capacity;
+} CSFM_DiagnosticArray;
+
+void CSFM_DiagnosticArray_deallocate(CSFM_DiagnosticArray *array);
+CSFM_Diagnostic CSFM_DiagnosticArray_get(CSFM_DiagnosticArray array, uint32_t index);
+const char *CSFM_DiagnosticCode_name(CSFM_DiagnosticCode code);
+
+// Spans point into the input, nothing is copied. A default attribute
+// (`\w grace|grace\w*`) has an empty key, see CSFM_Marker_defaultAttribute.
+typedef struct {
+    uint32_t key_start;
+    uint32_t key_end;
+    uint32_t value_start;
+    uint32_t value_end;
+    uint32_t node;
+} CSFM_Attribute;
+
+typedef struct {
+    CSFM_Attribute *buffer;
+    uint32_t length;
+    uint32_t capacity;
+} CSFM_AttributeArray;
+
+void CSFM_AttributeArray_deallocate(CSFM_AttributeArray *array);
+CSFM_Attribute CSFM_AttributeArray_get(CSFM_AttributeArray array, uint32_t index);
+// The key a default attribute stands for, or NULL if the marker has none.
+const char *CSFM_Marker_defaultAttribute(CSFM_Marker marker);
+
+// Node indices of every opening marker, grouped by marker and ascending
+// within each group. Built during the parse with CSFM_OPTION_POSTING_LISTS.
+typedef struct {
+    CSFM_IndexArray nodes;
+    // CSFM_MARKER_COUNT + 1 entries, marker `m` owns
+    // nodes.buffer[offsets.buffer[m] .. offsets.buffer[m + 1]).
+    CSFM_IndexArray offsets;
+} CSFM_PostingLists;
+
+void CSFM_PostingLists_deallocate(CSFM_PostingLists *postings);
+uint32_t CSFM_PostingLists_count(const CSFM_PostingLists *postings, CSFM_Marker marker);
+// Returns the node index of the `index`th occurrence of `marker`.
+uint32_t CSFM_PostingLists_get(const CSFM_PostingLists *postings, CSFM_Marker marker, uint32_t index);
 
 typedef struct {
     CSFM_String8Slice input;
     CSFM_NodeArray tree;
+    CSFM_DiagnosticArray diagnostics;
+    CSFM_PostingLists postings;
+    CSFM_AttributeArray attributes;
+    CSFM_ErrorType error;
+    // NOTE(mattg): Only meaningful when `error` is CSFM_ERROR_INVALID_UTF8.
+    uint32_t error_offset;
 } CSFM_ParseResult;
 
 CSFM_ParseResult CSFM_Parse(uint8_t *buf, uint32_t size);
+CSFM_ParseResult CSFM_ParseWithOptions(uint8_t *buf, uint32_t size, CSFM_Options options);
+void CSFM_ParseResult_deallocate(CSFM_ParseResult *result);
+
+// Half-open range of node indices.
+typedef struct {
+    uint32_t first;
+    uint32_t end;
+} CSFM_NodeRange;
+
+// The nodes a marker governs, starting with the marker node itself: up to
+// and including its closing marker for character and note markers, up to
+// the next verse/chapter for `\v`/`\c`, up to the next paragraph level
+// marker for everything else.
+CSFM_NodeRange CSFM_MarkerSpan(const CSFM_ParseResult *result, uint32_t nodeIndex);
+
+typedef struct {
+    const CSFM_ParseResult *result;
+    CSFM_Marker marker;
+    uint32_t position;
+} CSFM_MarkerQuery;
+
+// Walks the posting list of `marker`. Needs a result parsed with
+// CSFM_OPTION_POSTING_LISTS.
+CSFM_MarkerQuery CSFM_MarkerQuery_begin(const CSFM_ParseResult *result, CSFM_Marker marker);
+bool CSFM_MarkerQuery_next(CSFM_MarkerQuery *query, CSFM_NodeRange *span);
+
+// Reusable buffers for parsing many documents in a row, e.g. one per worker
+// thread. Results returned from a context borrow its buffers: they stay valid
+// until the next call on the same context and must not be deallocated.
+// Once warmed up, parsing allocates nothing.
+typedef struct {
+    CSFM_TokenArray tokens;
+    CSFM_NodeArray tree;
+    CSFM_DiagnosticArray diagnostics;
+    CSFM_PostingLists postings;
+    CSFM_AttributeArray attributes;
+    // Node indices of the markers that are still open.
+    CSFM_IndexArray marker_stack;
+    // Node indices of opening markers in document order, bucketed into
+    // `postings` once the parse is done.
+    CSFM_IndexArray marker_nodes;
+
+    // Every `shrink_interval` calls (tokenize and parse both count), a buffer
+    // whose capacity is more than `shrink_factor` times the most it held
+    // during that window is cut back to twice that. A shrink_interval of 0
+    // never shrinks.
+    uint32_t shrink_interval;
+    uint32_t shrink_factor;
+    uint32_t calls;
+    uint32_t peak_tokens;
+    uint32_t peak_nodes;
+    uint32_t peak_diagnostics;
+    uint32_t peak_attributes;
+    // Opening markers, the length of `marker_nodes` and `postings.nodes`.
+    uint32_t peak_markers;
+    // Deepest `marker_stack` got, tracked by the parse loop since the stack
+    // is empty again once it is done.
+    uint32_t peak_depth;
+} CSFM_Context;
+
+void CSFM_Context_init(CSFM_Context *context);
+void CSFM_Context_deallocate(CSFM_Context *context);
+CSFM_TokenResult CSFM_Context_tokenize(CSFM_Context *context, uint8_t *buf, uint32_t size, CSFM_Options options);
+CSFM_ParseResult CSFM_Context_parse(CSFM_Context *context, uint8_t *buf, uint32_t size, CSFM_Options options);
+
+// A byte range of a document from one `\c` up to the next. Chapter 0 of a
+// CSFM_LazyDocument is whatever comes before the first `\c`.
+typedef struct {
+    uint32_t start;
+    uint32_t end;
+    // The number after `\c`, 0 for the front matter.
+    uint32_t number;
+    bool resident;
+    // Parsed on its own: offsets in it are relative to `start`.
+    CSFM_ParseResult result;
+    // Neighbours in the most recently used list.
+    uint32_t newer;
+    uint32_t older;
+} CSFM_Chapter;
+
+// Opening only skims the input for `\c` markers, each chapter is parsed on
+// first access and kept until more than `max_resident` chapters are parsed,
+// then the least recently used one is dropped.
+typedef struct {
+    CSFM_String8Slice input;
+    CSFM_Options options;
+    CSFM_Chapter *chapters;
+    uint32_t chapter_count;
+    uint32_t max_resident;
+    uint32_t resident;
+    uint32_t newest;
+    uint32_t oldest;
+    CSFM_Context context;
+} CSFM_LazyDocument;
+
+CSFM_ErrorType CSFM_LazyDocument_open(
+    CSFM_LazyDocument *document, uint8_t *buf, uint32_t size, CSFM_Options options, uint32_t maxResident
+);
+void CSFM_LazyDocument_deallocate(CSFM_LazyDocument *document);
+// Index of the chapter numbered `number`, or UINT32_MAX.
+uint32_t CSFM_LazyDocument_find(const CSFM_LazyDocument *document, uint32_t number);
+// Parses chapter `index` if it is not resident yet. The result stays valid
+// until the chapter is evicted, which loading other chapters may do. NULL
+// if `index` is out of range. Running out of memory gives an empty result
+// with CSFM_ERROR_OUT_OF_MEMORY that is not cached, the next call retries.
+const CSFM_ParseResult *CSFM_LazyDocument_chapter(CSFM_LazyDocument *document, uint32_t index);
+void CSFM_LazyDocument_evict(CSFM_LazyDocument *document, uint32_t index);
+void CSFM_LazyDocument_evictAll(CSFM_LazyDocument *document);
+
+// One verse of plain text. `book` and `verse` point into the parsed input,
+// `text` into the extractor and is only valid during the callback.
+typedef struct {
+    CSFM_String8Slice book;
+    uint32_t chapter;
+    // As written after `\v`, e.g. "16", "3-4" or "2a".
+    CSFM_String8Slice verse;
+    CSFM_String8Slice text;
+} CSFM_VerseRecord;
+
+typedef void (*CSFM_VerseCallback)(void *user, const CSFM_VerseRecord *record);
+
+// Walks a parse result verse by verse and keeps only the text. Markers are
+// removed, the content of a marker with `drop[marker]` set is removed along
+// with it, and runs of whitespace and line breaks become a single space.
+// Parse with CSFM_OPTION_ATTRIBUTES, otherwise `|key="value"` lists stay in
+// the text.
+typedef struct {
+    bool drop[CSFM_MARKER_COUNT];
+    uint8_t *buffer;
+    uint32_t length;
+    uint32_t capacity;
+} CSFM_VerseExtractor;
+
+// Drops headers, headings, notes, figures and alternate/published numbers,
+// keeps everything else (including `\add`).
+void CSFM_VerseExtractor_init(CSFM_VerseExtractor *extractor);
+void CSFM_VerseExtractor_deallocate(CSFM_VerseExtractor *extractor);
+CSFM_ErrorType CSFM_VerseExtractor_run(
+    CSFM_VerseExtractor *extractor, const CSFM_ParseResult *result, CSFM_VerseCallback callback, void *user
+);
+
+// Ready made callbacks, `user` is a FILE *.
+// `BOOK<TAB>CHAPTER<TAB>VERSE<TAB>TEXT<LF>`, tabs in the text become spaces.
+void CSFM_VerseRecord_writeTSV(void *user, const CSFM_VerseRecord *record);
+// Little endian u32 length (or value) before each field:
+// book length, book, chapter, verse length, verse, text length, text.
+void CSFM_VerseRecord_writeBinary(void *user, const CSFM_VerseRecord *record);
+
+// Word level inverted index over a corpus of parsed books, built from the
+// extracted verse text (see CSFM_VerseExtractor). Words are runs of letters,
+// digits and combining marks; Latin, Greek and Cyrillic are case folded,
+// every CJK ideograph is a word of its own.
+//
+// The index is a single flat buffer meant to be written to disk as is and
+// mmap'ed back, all fields are little endian and 4 byte aligned:
+//   CSFM_IndexHeader
+//   CSFM_IndexBook[book_count]
+//   CSFM_IndexTerm[term_count], sorted by the bytes of the term
+//   string pool (terms and book names)
+//   postings
+// The postings of a term are one block per book in book order:
+//   varint book, varint count, varint byte length, then `count` postings as
+//   delta encoded varints: chapter delta, then the verse (a delta when the
+//   chapter did not change), then the offset (a delta when the verse did
+//   not change).
+#define CSFM_INDEX_MAGIC 0x49465343 // "CSFI"
+#define CSFM_INDEX_VERSION 1
+// Longest phrase, in words, CSFM_IndexView_phrase accepts.
+#define CSFM_INDEX_MAX_PHRASE 16
+// Longest query, in bytes.
+#define CSFM_INDEX_MAX_QUERY 1024
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t book_count;
+    uint32_t term_count;
+    uint32_t strings_offset;
+    uint32_t strings_length;
+    uint32_t postings_offset;
+    uint32_t postings_length;
+} CSFM_IndexHeader;
+
+typedef struct {
+    uint32_t name_offset;
+    uint32_t name_length;
+} CSFM_IndexBook;
+
+typedef struct {
+    uint32_t string_offset;
+    uint32_t string_length;
+    uint32_t postings_offset;
+    uint32_t postings_length;
+    uint32_t count;
+} CSFM_IndexTerm;
+
+typedef struct {
+    // Position of the parse result in the corpus passed to CSFM_Index_build.
+    uint32_t book;
+    uint32_t chapter;
+    // The leading number of the verse, "3-4" is verse 3.
+    uint32_t verse;
+    // Word offset inside the verse.
+    uint32_t offset;
+} CSFM_IndexPosting;
+
+// Builds the index of `books` into a newly allocated buffer, the caller frees
+// `out->ptr`. With CSFM_THREADS the books are split over `threads` workers,
+// otherwise (or with 0 or 1) they are indexed one after another.
+CSFM_ErrorType CSFM_Index_build(
+    const CSFM_ParseResult *books, uint32_t bookCount, uint32_t threads, CSFM_String8Slice *out
+);
+
+// Read only view of an index, nothing is copied so `bytes` (e.g. an mmap'ed
+// file) has to outlive it.
+typedef struct {
+    const CSFM_IndexHeader *header;
+    const CSFM_IndexBook *books;
+    const CSFM_IndexTerm *terms;
+    const uint8_t *strings;
+    const uint8_t *postings;
+} CSFM_IndexView;
+
+// Returns false if `bytes` is not an index this version can read.
+bool CSFM_IndexView_init(CSFM_IndexView *view, const uint8_t *bytes, uint32_t size);
+CSFM_String8Slice CSFM_IndexView_bookName(const CSFM_IndexView *view, uint32_t book);
+// Index into `view->terms` of an already folded term, or UINT32_MAX.
+uint32_t CSFM_IndexView_find(const CSFM_IndexView *view, const uint8_t *term, uint32_t length);
+// Finds every occurrence of the words of `query` in a row inside one verse,
+// a single word is a plain term lookup. Writes the position of the first
+// word of up to `capacity` matches to `out` and returns the total number of
+// matches.
+uint32_t CSFM_IndexView_phrase(
+    const CSFM_IndexView *view, const uint8_t *query, uint32_t length, CSFM_IndexPosting *out, uint32_t capacity
+);
+
+typedef enum {
+    CSFM_DIFF_VERSE_ADDED,
+    CSFM_DIFF_VERSE_REMOVED,
+    // Only words changed.
+    CSFM_DIFF_TEXT,
+    // Only markers or attribute lists changed.
+    CSFM_DIFF_MARKER,
+    // Too much changed to line the verse up, the ranges cover all of it.
+    CSFM_DIFF_VERSE_REWRITTEN,
+} CSFM_DiffKind;
+
+// Byte ranges into the old and new input. An insertion has an empty old
+// range where it goes, a deletion an empty new range.
+typedef struct {
+    CSFM_DiffKind kind;
+    uint32_t chapter;
+    // As written after `\v`, empty for what comes before the first verse
+    // of a chapter (chapter 0 is everything before the first `\c`).
+    CSFM_String8Slice verse;
+    uint32_t old_start;
+    uint32_t old_end;
+    uint32_t new_start;
+    uint32_t new_end;
+} CSFM_DiffChange;
+
+typedef struct {
+    CSFM_DiffChange *buffer;
+    uint32_t length;
+    uint32_t capacity;
+} CSFM_DiffChangeArray;
+
+void CSFM_DiffChangeArray_deallocate(CSFM_DiffChangeArray *array);
+CSFM_DiffChange CSFM_DiffChangeArray_get(CSFM_DiffChangeArray array, uint32_t index);
+const char *CSFM_DiffKind_name(CSFM_DiffKind kind);
+
+typedef struct {
+    CSFM_DiffChangeArray changes;
+    // Verses present on both sides, and how many of those differ.
+    uint32_t verses;
+    uint32_t changed_verses;
+    CSFM_ErrorType error;
+} CSFM_DiffResult;
+
+// Lines both documents up by (chapter, verse) and diffs words and markers
+// inside the verses whose content hash differs. Whitespace and line breaks
+// are not content.
+CSFM_DiffResult CSFM_Diff(const CSFM_ParseResult *oldResult, const CSFM_ParseResult *newResult);
+// Diffs `oldResults[i]` against `newResults[i]` into `results[i]`, spread
+// over `threads` threads with CSFM_THREADS.
+void CSFM_DiffMany(
+    const CSFM_ParseResult *oldResults, const CSFM_ParseResult *newResults, uint32_t count, uint32_t threads,
+    CSFM_DiffResult *results
+);
+void CSFM_DiffResult_deallocate(CSFM_DiffResult *result);
+
+#if defined(CSFM_THREADS)
+// Parses a stream on three threads: a reader fills fixed size blocks, a
+// tokenizer cuts them into batches at line breaks and tokenizes them, and
+// the calling thread parses the tokens. The stages hand blocks and batches
+// to each other through bounded lock-free rings, so a slow stage stalls the
+// ones before it instead of buffering the whole stream.
+#define CSFM_PIPELINE_BLOCK_SIZE (64 * 1024)
+// Blocks and batches in flight between two stages, a power of two.
+#define CSFM_PIPELINE_DEPTH 8
+
+typedef enum {
+    CSFM_STAGE_READER,
+    CSFM_STAGE_TOKENIZER,
+    CSFM_STAGE_PARSER,
+    CSFM_STAGE_COUNT,
+} CSFM_PipelineStage;
+
+typedef struct {
+    // Time each stage spent working, and waiting on its neighbours (an empty
+    // input or a full output), in nanoseconds.
+    uint64_t busy_ns[CSFM_STAGE_COUNT];
+    uint64_t wait_ns[CSFM_STAGE_COUNT];
+    uint64_t wall_ns;
+    uint32_t blocks;
+    uint32_t batches;
+} CSFM_PipelineStats;
+
+// Reads `file` to the end and parses it. The result owns `input.ptr`, free
+// it after CSFM_ParseResult_deallocate. `stats` may be NULL. Needs POSIX
+// clocks, e.g. _POSIX_C_SOURCE 199309L.
+CSFM_ParseResult CSFM_Pipeline_parse(FILE *file, CSFM_Options options, CSFM_PipelineStats *stats);
+#endif
+
+// NOTE(mattg): Define CSFM_TRACE to record a timeline of where the time goes
+// (tokenize, build_tree, parse, emit, ...) as Chrome Trace Event JSON, for
+// chrome://tracing or ui.perfetto.dev. Every thread appends to a buffer only
+// it writes to, there are no locks on the recording path. Without CSFM_TRACE
+// the macros expand to nothing. Needs POSIX clocks like CSFM_THREADS does.
+#if defined(CSFM_TRACE)
+typedef struct {
+    const char *name;
+    // Not copied, has to outlive the trace. NULL leaves the argument out.
+    const char *file;
+    uint64_t bytes;
+    uint64_t start_ns;
+    uint64_t end_ns;
+} CSFM_TraceEvent;
+
+uint64_t CSFM_Trace_now(void);
+// Records an event that started at `start` (from CSFM_Trace_now) and ends now.
+void CSFM_Trace_record(const char *name, uint64_t start, const char *file, uint64_t bytes);
+// Labels the calling thread in the timeline, `name` is not copied.
+void CSFM_Trace_nameThread(const char *name);
+// Writes every event recorded so far, by all threads. Events a thread records
+// while this runs may or may not make it in.
+CSFM_ErrorType CSFM_Trace_write(FILE *file);
+
+#define CSFM_TRACE_BEGIN(scope) uint64_t CSFM_traceStart_##scope = CSFM_Trace_now()
+#define CSFM_TRACE_END(scope, file, bytes) CSFM_Trace_record(#scope, CSFM_traceStart_##scope, (file), (bytes))
+#define CSFM_TRACE_THREAD(name) CSFM_Trace_nameThread(name)
+#else
+#define CSFM_TRACE_BEGIN(scope)
+#define CSFM_TRACE_END(scope, file, bytes)
+#define CSFM_TRACE_THREAD(name)
+#endif
 
 #endif // CSFM_HEADER
 
 #ifdef CSFM_IMPLEMENTATION
 #define CSFM_IMPLEMENTATION
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// NOTE(mattg): Define CSFM_THREADS (and link with -pthread) to spread corpus
+// level work like CSFM_Index_build over POSIX threads.
+#if defined(CSFM_THREADS)
+#include <pthread.h>
+#include <sched.h>
+#endif
+#if defined(CSFM_THREADS) || defined(CSFM_TRACE)
+#include <time.h>
+
+static uint64_t CSFM_nanoseconds(void) {
+    struct timespec now = {0};
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+#endif
+
 static inline char CSFM_String8Slice_get(CSFM_String8Slice slice, uint32_t index) {
     if (index >= slice.length) {
         // NOTE(mattg): This should be at the end of the slice
@@ -327,207 +923,915 @@ static inline char CSFM_String8Slice_get(CSFM_String8Slice slice, uint32_t index
     return slice.ptr[index];
 }
 
-// NOTE(mattg): For testing purposes only
-void CSFM_Token_print(CSFM_Token token, CSFM_String8Slice str) {
-    uint32_t length = token.end - token.start;
-    char *string = (char *)&str.ptr[token.start];
-    switch (token.type) {
-    case CSFM_TOKEN_NULL:
-        printf("[NULL]\n");
-        break;
-    case CSFM_TOKEN_CR:
-        printf("[CR]\n");
-        break;
-    case CSFM_TOKEN_LF:
-        printf("[LF]\n");
-        break;
-    default:
-        printf("[%*.*s]", length, length, string);
+static inline uint32_t CSFM_countTrailingZeros32(uint32_t value) {
+#if defined(__GNUC__) || defined(__clang__)
+    return (uint32_t)__builtin_ctz(value);
+#else
+    uint32_t count = 0;
+    while ((value & 1) == 0) {
+        value >>= 1;
+        count++;
     }
+    return count;
+#endif
 }
 
-CSFM_ErrorType CSFM_TokenArray_allocate(CSFM_TokenArray *array, uint32_t capacity) {
-    if (array == NULL) {
-        return CSFM_ERROR_SUCCESS;
+// Returns the length of the leading run of ASCII bytes. 16 bytes at a time
+// with SSE2, otherwise 8 bytes at a time in a general purpose register.
+static inline uint32_t CSFM_UTF8_asciiPrefix(const uint8_t *ptr, uint32_t length) {
+    uint32_t index = 0;
+#if defined(__SSE2__)
+    while (index + 16 <= length) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)&ptr[index]);
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(chunk);
+        if (mask != 0) {
+            return index + CSFM_countTrailingZeros32(mask);
+        }
+        index += 16;
     }
-    capacity = capacity <= CSFM_TOKEN_ARRAY_CAPACITY_MAX ? capacity : CSFM_TOKEN_ARRAY_CAPACITY_MAX;
+#endif
+    while (index + 8 <= length) {
+        uint64_t chunk;
+        memcpy(&chunk, &ptr[index], sizeof(chunk));
+        if ((chunk & 0x8080808080808080ULL) != 0) {
+            break;
+        }
+        index += 8;
+    }
+    while (index < length && ptr[index] < 0x80) {
+        index++;
+    }
+    return index;
+}
 
-    if (capacity == 0) {
-        array->buffer = NULL;
-        array->capacity = 0;
-        array->length = 0;
-        return CSFM_ERROR_SUCCESS;
+// Returns the length of the well-formed UTF-8 sequence starting at `index`
+// (see table 3-7 of the Unicode standard), or 0 if it is ill-formed.
+static inline uint32_t CSFM_UTF8_sequenceLength(const uint8_t *ptr, uint32_t length, uint32_t index) {
+    uint8_t lead = ptr[index];
+    uint32_t remaining = length - index;
+    uint8_t low = 0x80;
+    uint8_t high = 0xBF;
+    uint32_t sequenceLength = 0;
+
+    if (lead < 0x80) {
+        return 1;
+    } else if (lead >= 0xC2 && lead <= 0xDF) {
+        sequenceLength = 2;
+    } else if (lead >= 0xE0 && lead <= 0xEF) {
+        sequenceLength = 3;
+        if (lead == 0xE0) {
+            low = 0xA0;
+        } else if (lead == 0xED) {
+            high = 0x9F;
+        }
+    } else if (lead >= 0xF0 && lead <= 0xF4) {
+        sequenceLength = 4;
+        if (lead == 0xF0) {
+            low = 0x90;
+        } else if (lead == 0xF4) {
+            high = 0x8F;
+        }
+    } else {
+        return 0;
     }
 
-    uint32_t size = sizeof(CSFM_Token) * capacity;
-    array->buffer = malloc(size);
-    if (array->buffer == NULL) {
-        array->capacity = 0;
-        array->length = 0;
-        return CSFM_ERROR_OUT_OF_MEMORY;
+    if (remaining < sequenceLength) {
+        return 0;
     }
-    // TODO(mattg): look into what secure memset is, use it if I should
-    memset(array->buffer, 0, size);
-    array->capacity = capacity;
-    array->length = 0;
-    return CSFM_ERROR_SUCCESS;
+    // NOTE(mattg): Only the first continuation byte has a restricted range.
+    if (ptr[index + 1] < low || ptr[index + 1] > high) {
+        return 0;
+    }
+    for (uint32_t i = 2; i < sequenceLength; i++) {
+        if ((ptr[index + i] & 0xC0) != 0x80) {
+            return 0;
+        }
+    }
+    return sequenceLength;
 }
 
-void CSFM_TokenArray_deallocate(CSFM_TokenArray *array) {
-    if (array == NULL) {
-        return;
+uint32_t CSFM_UTF8_findInvalid(const uint8_t *ptr, uint32_t length) {
+    if (ptr == NULL) {
+        return length;
     }
-    if (array->buffer != NULL) {
-        free(array->buffer);
-        array->buffer = NULL;
+    uint32_t index = 0;
+    while (index < length) {
+        index += CSFM_UTF8_asciiPrefix(&ptr[index], length - index);
+        // NOTE(mattg): Stay on the scalar path while we are inside a run of
+        // multi-byte characters (Greek, Hebrew, ...), the vector check would
+        // bail out on the very first byte anyway.
+        while (index < length && ptr[index] >= 0x80) {
+            uint32_t sequenceLength = CSFM_UTF8_sequenceLength(ptr, length, index);
+            if (sequenceLength == 0) {
+                return index;
+            }
+            index += sequenceLength;
+        }
     }
-    array->length = 0;
-    array->capacity = 0;
+    return length;
 }
 
-void CSFM_TokenArray_reuse(CSFM_TokenArray *array) {
-    if (array == NULL) {
-        return;
+#define CSFM_UTF8_VALIDATE_BLOCK 4096
+
+// Validates input[*validated, end) once a block has piled up behind the scan,
+// or on `flush`. The bytes are still in cache and get checked in long
+// stretches instead of one short token at a time. `end` must be a token
+// boundary so no multi-byte sequence is split.
+static inline bool CSFM_UTF8_validateBehind(
+    CSFM_String8Slice input, uint32_t *validated, uint32_t end, bool flush, uint32_t *errorOffset
+) {
+    // NOTE(mattg): The NULL token at the end of the input ends one past it.
+    end = end < input.length ? end : input.length;
+    uint32_t length = end - *validated;
+    if (!flush && length < CSFM_UTF8_VALIDATE_BLOCK) {
+        return true;
     }
-    if (array->buffer != NULL) {
-        uint32_t size = sizeof(CSFM_Token) * array->capacity;
-        memset(array->buffer, 0, size);
+    uint32_t invalid = CSFM_UTF8_findInvalid(&input.ptr[*validated], length);
+    if (invalid != length) {
+        *errorOffset = *validated + invalid;
+        return false;
     }
-    array->length = 0;
+    *validated = end;
+    return true;
 }
 
-static CSFM_ErrorType CSFM_TokenArray_resize(CSFM_TokenArray *array, uint32_t newCapacity) {
-    if (array == NULL || newCapacity <= array->capacity) {
-        return CSFM_ERROR_SUCCESS;
+static inline uint32_t CSFM_UTF8_encode(uint32_t codepoint, uint8_t *out) {
+    if (codepoint < 0x80) {
+        out[0] = (uint8_t)codepoint;
+        return 1;
+    } else if (codepoint < 0x800) {
+        out[0] = (uint8_t)(0xC0 | (codepoint >> 6));
+        out[1] = (uint8_t)(0x80 | (codepoint & 0x3F));
+        return 2;
+    } else if (codepoint < 0x10000) {
+        out[0] = (uint8_t)(0xE0 | (codepoint >> 12));
+        out[1] = (uint8_t)(0x80 | ((codepoint >> 6) & 0x3F));
+        out[2] = (uint8_t)(0x80 | (codepoint & 0x3F));
+        return 3;
     }
-    newCapacity = newCapacity <= CSFM_TOKEN_ARRAY_CAPACITY_MAX ? newCapacity : CSFM_TOKEN_ARRAY_CAPACITY_MAX;
+    out[0] = (uint8_t)(0xF0 | (codepoint >> 18));
+    out[1] = (uint8_t)(0x80 | ((codepoint >> 12) & 0x3F));
+    out[2] = (uint8_t)(0x80 | ((codepoint >> 6) & 0x3F));
+    out[3] = (uint8_t)(0x80 | (codepoint & 0x3F));
+    return 4;
+}
 
-    {
-        uint32_t size = sizeof(CSFM_Token) * newCapacity;
-        CSFM_Token *newBuffer = realloc(array->buffer, size);
-        if (newBuffer == NULL) {
-            return CSFM_ERROR_OUT_OF_MEMORY;
+// NOTE(mattg): 0x80-0x9F are the only bytes where CP1252 and Latin-1 differ.
+// Undefined slots become U+FFFD.
+static const uint16_t CSFM_CP1252_HIGH[32] = {
+    0x20AC, 0xFFFD, 0x201A, 0x0192, 0x201E, 0x2026, 0x2020, 0x2021,
+    0x02C6, 0x2030, 0x0160, 0x2039, 0x0152, 0xFFFD, 0x017D, 0xFFFD,
+    0xFFFD, 0x2018, 0x2019, 0x201C, 0x201D, 0x2022, 0x2013, 0x2014,
+    0x02DC, 0x2122, 0x0161, 0x203A, 0x0153, 0xFFFD, 0x017E, 0x0178,
+};
+
+static inline uint32_t CSFM_asciiLower(uint32_t c) {
+    return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+static bool CSFM_asciiEqualsIgnoreCase(const uint8_t *ptr, uint32_t length, const char *literal) {
+    uint32_t literalLength = (uint32_t)strlen(literal);
+    if (length != literalLength) {
+        return false;
+    }
+    for (uint32_t i = 0; i < length; i++) {
+        if (CSFM_asciiLower(ptr[i]) != CSFM_asciiLower((uint8_t)literal[i])) {
+            return false;
         }
-        array->buffer = newBuffer;
     }
-    int32_t capacityDifference = newCapacity - array->capacity;
-    int32_t addedSize = sizeof(CSFM_Token) * capacityDifference;
-    if (addedSize > 0) {
-        memset(&array->buffer[array->capacity], 0, addedSize);
+    return true;
+}
+
+CSFM_Encoding CSFM_Encoding_detect(const uint8_t *buf, uint32_t size, uint32_t *bomLength) {
+    uint32_t bom = 0;
+    CSFM_Encoding encoding = CSFM_ENCODING_UTF8;
+
+    if (size >= 3 && buf[0] == 0xEF && buf[1] == 0xBB && buf[2] == 0xBF) {
+        bom = 3;
+    } else if (size >= 2 && buf[0] == 0xFF && buf[1] == 0xFE) {
+        bom = 2;
+        encoding = CSFM_ENCODING_UTF16LE;
+    } else if (size >= 2 && buf[0] == 0xFE && buf[1] == 0xFF) {
+        bom = 2;
+        encoding = CSFM_ENCODING_UTF16BE;
+    } else if (size >= 2 && buf[0] == '\\' && buf[1] == 0) {
+        // NOTE(mattg): A BOM-less UTF-16 file still starts with `\id`.
+        encoding = CSFM_ENCODING_UTF16LE;
+    } else if (size >= 2 && buf[0] == 0 && buf[1] == '\\') {
+        encoding = CSFM_ENCODING_UTF16BE;
+    } else {
+        // NOTE(mattg): `\ide` belongs right after `\id`/`\usfm`, so only the
+        // first few lines are worth looking at.
+        uint32_t limit = size < 4096 ? size : 4096;
+        for (uint32_t i = bom; i + 5 <= limit; i++) {
+            if (buf[i] != '\\' || memcmp(&buf[i + 1], "ide", 3) != 0 ||
+                (buf[i + 4] != ' ' && buf[i + 4] != '\t')) {
+                continue;
+            }
+            uint32_t start = i + 5;
+            while (start < limit && (buf[start] == ' ' || buf[start] == '\t')) {
+                start++;
+            }
+            uint32_t end = start;
+            while (end < limit && buf[end] != '\r' && buf[end] != '\n' &&
+                   buf[end] != ' ' && buf[end] != '\t' && buf[end] != '\\') {
+                end++;
+            }
+            const uint8_t *value = &buf[start];
+            uint32_t length = end - start;
+            if (CSFM_asciiEqualsIgnoreCase(value, length, "CP1252") ||
+                CSFM_asciiEqualsIgnoreCase(value, length, "CP-1252") ||
+                CSFM_asciiEqualsIgnoreCase(value, length, "1252") ||
+                CSFM_asciiEqualsIgnoreCase(value, length, "WINDOWS-1252")) {
+                encoding = CSFM_ENCODING_CP1252;
+            } else if (
+                CSFM_asciiEqualsIgnoreCase(value, length, "LATIN-1") ||
+                CSFM_asciiEqualsIgnoreCase(value, length, "LATIN1") ||
+                CSFM_asciiEqualsIgnoreCase(value, length, "ISO-8859-1") ||
+                CSFM_asciiEqualsIgnoreCase(value, length, "8859-1")) {
+                encoding = CSFM_ENCODING_LATIN1;
+            }
+            break;
+        }
     }
-    array->capacity = newCapacity;
 
-    return CSFM_ERROR_SUCCESS;
+    if (bomLength != NULL) {
+        *bomLength = bom;
+    }
+    return encoding;
 }
 
-static CSFM_ErrorType CSFM_TokenArray_push(CSFM_TokenArray *array, CSFM_Token token) {
-    if (array == NULL || array->buffer == NULL) {
-        return CSFM_ERROR_SUCCESS;
+// Decodes one character. Returns the number of input bytes it takes, or 0 if
+// the input ends inside it.
+static inline uint32_t CSFM_Encoding_decode(
+    CSFM_Encoding encoding, const uint8_t *in, uint32_t length, uint32_t *codepoint
+) {
+    uint32_t unit = 0;
+    switch (encoding) {
+    case CSFM_ENCODING_UTF8: {
+        uint32_t sequenceLength = CSFM_UTF8_sequenceLength(in, length, 0);
+        if (sequenceLength == 0) {
+            // NOTE(mattg): Only a truncated tail is worth waiting for, any
+            // other ill-formed byte is replaced on its own.
+            uint32_t expected = in[0] >= 0xF0 ? 4 : in[0] >= 0xE0 ? 3 : 2;
+            if (in[0] >= 0xC2 && in[0] <= 0xF4 && length < expected &&
+                CSFM_UTF8_findInvalid(&in[1], length - 1) == length - 1) {
+                return 0;
+            }
+            *codepoint = 0xFFFD;
+            return 1;
+        }
+        // NOTE(mattg): Re-encoding is cheaper to get right than copying here.
+        uint32_t value = in[0];
+        if (sequenceLength > 1) {
+            value &= 0x7F >> sequenceLength;
+            for (uint32_t i = 1; i < sequenceLength; i++) {
+                value = (value << 6) | (in[i] & 0x3F);
+            }
+        }
+        *codepoint = value;
+        return sequenceLength;
     }
-
-    if (array->length >= array->capacity) {
-        CSFM_ErrorType err = CSFM_TokenArray_resize(array, array->length * 2);
-        if (err != CSFM_ERROR_SUCCESS) {
-            return err;
+    case CSFM_ENCODING_LATIN1:
+        *codepoint = in[0];
+        return 1;
+    case CSFM_ENCODING_CP1252:
+        *codepoint = (in[0] >= 0x80 && in[0] < 0xA0) ? CSFM_CP1252_HIGH[in[0] - 0x80] : in[0];
+        return 1;
+    case CSFM_ENCODING_UTF16LE:
+    case CSFM_ENCODING_UTF16BE:
+        if (length < 2) {
+            return 0;
         }
+        unit = encoding == CSFM_ENCODING_UTF16LE ?
+            (uint32_t)in[0] | ((uint32_t)in[1] << 8) :
+            ((uint32_t)in[0] << 8) | (uint32_t)in[1];
+        if (unit >= 0xD800 && unit <= 0xDBFF) {
+            if (length < 4) {
+                return 0;
+            }
+            uint32_t low = encoding == CSFM_ENCODING_UTF16LE ?
+                (uint32_t)in[2] | ((uint32_t)in[3] << 8) :
+                ((uint32_t)in[2] << 8) | (uint32_t)in[3];
+            if (low >= 0xDC00 && low <= 0xDFFF) {
+                *codepoint = 0x10000 + ((unit - 0xD800) << 10) + (low - 0xDC00);
+                return 4;
+            }
+            *codepoint = 0xFFFD;
+            return 2;
+        }
+        *codepoint = (unit >= 0xDC00 && unit <= 0xDFFF) ? 0xFFFD : unit;
+        return 2;
     }
+    *codepoint = 0xFFFD;
+    return 1;
+}
 
-    array->buffer[array->length] = token;
-    array->length++;
-    return CSFM_ERROR_SUCCESS;
+// Returns the length of the leading run of ASCII code units in a UTF-16
+// buffer, counted in units. Four units at a time in a general purpose register.
+static inline uint32_t CSFM_UTF16_asciiPrefix(const uint8_t *ptr, uint32_t units, bool littleEndian) {
+    uint32_t index = 0;
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+    bool sameOrder = !littleEndian;
+#else
+    bool sameOrder = littleEndian;
+#endif
+    // NOTE(mattg): Every high byte must be 0 and every low byte < 0x80.
+    uint64_t mask = sameOrder ? 0xFF80FF80FF80FF80ULL : 0x80FF80FF80FF80FFULL;
+    while (index + 4 <= units) {
+        uint64_t chunk;
+        memcpy(&chunk, &ptr[index * 2], sizeof(chunk));
+        if ((chunk & mask) != 0) {
+            break;
+        }
+        index += 4;
+    }
+    uint32_t highByte = littleEndian ? 1 : 0;
+    while (index < units) {
+        const uint8_t *bytes = &ptr[index * 2];
+        if (bytes[highByte] != 0 || bytes[1 - highByte] >= 0x80) {
+            break;
+        }
+        index++;
+    }
+    return index;
 }
 
-CSFM_Token CSFM_TokenArray_get(CSFM_TokenArray array, uint32_t index) {
-    if (index < array.length && array.buffer != NULL) {
-        return array.buffer[index];
+void CSFM_OffsetMap_deallocate(CSFM_OffsetMap *map) {
+    if (map == NULL) {
+        return;
     }
-    CSFM_Token stub = {0};
-    return stub;
+    if (map->buffer != NULL) {
+        free(map->buffer);
+        map->buffer = NULL;
+    }
+    map->length = 0;
+    map->capacity = 0;
 }
 
-static inline CSFM_TokenType peekTokenType(CSFM_String8Slice str, uint32_t index) {
-    CSFM_TokenType type = CSFM_TOKEN_NULL;
-    switch (CSFM_String8Slice_get(str, index)) {
-    case '\0':
-        type = CSFM_TOKEN_NULL;
-        break;
-    case ' ':
-    case '\t':
-        type = CSFM_TOKEN_WS;
-        break;
-    case '\r':
-        type = CSFM_TOKEN_CR;
-        break;
-    case '\n':
-        type = CSFM_TOKEN_LF;
-        break;
-    case '/':
-        type = CSFM_TOKEN_FORWARDSLASH;
-        break;
-    case '\\':
-        type = CSFM_TOKEN_BACKSLASH;
-        break;
-    case '|':
-        type = CSFM_TOKEN_PIPE;
-        break;
-    case '.':
-        type = CSFM_TOKEN_PERIOD;
-        break;
-    case ',':
-        type = CSFM_TOKEN_COMMA;
-        break;
-    case ':':
-        type = CSFM_TOKEN_COLON;
-        break;
-    case ';':
-        type = CSFM_TOKEN_SEMICOLON;
-        break;
-    case '~':
-        type = CSFM_TOKEN_TILDE;
-        break;
-    case '*':
-        type = CSFM_TOKEN_ASTERISK;
-        break;
-    case '+':
-        type = CSFM_TOKEN_PLUS;
-        break;
-    case '-':
-        type = CSFM_TOKEN_MINUS;
-        break;
-    case '=':
-        type = CSFM_TOKEN_EQUAL;
-        break;
-    case '"':
-        type = CSFM_TOKEN_DOUBLE_QUOTE;
-        break;
-    case '0':
-    case '1':
-    case '2':
-    case '3':
-    case '4':
-    case '5':
-    case '6':
-    case '7':
-    case '8':
-    case '9':
-        type = CSFM_TOKEN_NUMBER;
-        break;
-    default:
-        type = CSFM_TOKEN_TEXT;
+static CSFM_ErrorType CSFM_OffsetMap_push(CSFM_OffsetMap *map, uint32_t output, uint32_t input) {
+    if (map->length >= map->capacity) {
+        uint32_t newCapacity = map->capacity == 0 ? 64 : map->capacity * 2;
+        CSFM_OffsetCheckpoint *newBuffer = realloc(map->buffer, sizeof(CSFM_OffsetCheckpoint) * newCapacity);
+        if (newBuffer == NULL) {
+            return CSFM_ERROR_OUT_OF_MEMORY;
+        }
+        map->buffer = newBuffer;
+        map->capacity = newCapacity;
     }
-    
-    return type;
+    map->buffer[map->length].output = output;
+    map->buffer[map->length].input = input;
+    map->length++;
+    return CSFM_ERROR_SUCCESS;
 }
 
-static inline CSFM_Token peekToken(CSFM_String8Slice str, uint32_t index) {
-    CSFM_Token token = {0};
-    token.start = index;
-    token.type = peekTokenType(str, index);
-    CSFM_TokenType type = CSFM_TOKEN_NULL;
-    switch (token.type) {
-    // NOTE(mattg): These are 1 character tokens
-    case CSFM_TOKEN_NULL:
-    case CSFM_TOKEN_CR:
+uint32_t CSFM_OffsetMap_originalOffset(
+    CSFM_OffsetMap *map, CSFM_Encoding encoding,
+    const uint8_t *input, uint32_t inputLength, uint32_t outputOffset
+) {
+    uint32_t output = 0;
+    uint32_t position = 0;
+    if (map != NULL && map->length > 0) {
+        // find the last checkpoint at or before `outputOffset`
+        uint32_t low = 0;
+        uint32_t high = map->length;
+        while (high - low > 1) {
+            uint32_t mid = low + (high - low) / 2;
+            if (map->buffer[mid].output <= outputOffset) {
+                low = mid;
+            } else {
+                high = mid;
+            }
+        }
+        if (map->buffer[low].output <= outputOffset) {
+            output = map->buffer[low].output;
+            position = map->buffer[low].input;
+        }
+    }
+
+    uint8_t scratch[4];
+    while (position < inputLength && output < outputOffset) {
+        uint32_t codepoint = 0;
+        uint32_t consumed = CSFM_Encoding_decode(encoding, &input[position], inputLength - position, &codepoint);
+        if (consumed == 0) {
+            break;
+        }
+        uint32_t written = CSFM_UTF8_encode(codepoint, scratch);
+        if (output + written > outputOffset) {
+            // NOTE(mattg): The offset points inside this character.
+            break;
+        }
+        output += written;
+        position += consumed;
+    }
+    return position;
+}
+
+void CSFM_Transcoder_init(CSFM_Transcoder *transcoder, CSFM_Encoding encoding, CSFM_OffsetMap *map) {
+    if (transcoder == NULL) {
+        return;
+    }
+    transcoder->encoding = encoding;
+    transcoder->input_offset = 0;
+    transcoder->output_offset = 0;
+    transcoder->map = map;
+}
+
+uint32_t CSFM_Transcoder_feed(
+    CSFM_Transcoder *transcoder,
+    const uint8_t *in, uint32_t inLength,
+    uint8_t *out, uint32_t outCapacity, uint32_t *produced
+) {
+    uint32_t inIndex = 0;
+    uint32_t outIndex = 0;
+    CSFM_Encoding encoding = transcoder->encoding;
+    bool utf16 = encoding == CSFM_ENCODING_UTF16LE || encoding == CSFM_ENCODING_UTF16BE;
+    CSFM_OffsetMap *map = transcoder->map;
+    uint32_t nextCheckpoint = 0;
+    if (map != NULL && map->length > 0) {
+        nextCheckpoint = map->buffer[map->length - 1].output + CSFM_OFFSET_MAP_STRIDE;
+    }
+
+    while (inIndex < inLength) {
+        if (map != NULL && transcoder->output_offset + outIndex >= nextCheckpoint) {
+            if (CSFM_OffsetMap_push(map, transcoder->output_offset + outIndex, transcoder->input_offset + inIndex) != CSFM_ERROR_SUCCESS) {
+                // NOTE(mattg): A missing checkpoint only makes lookups slower.
+                map = NULL;
+            }
+            nextCheckpoint = transcoder->output_offset + outIndex + CSFM_OFFSET_MAP_STRIDE;
+        }
+
+        // ASCII fast path, copied (or narrowed) in bulk.
+        uint32_t outSpace = outCapacity - outIndex;
+        // NOTE(mattg): ASCII maps 1:1, so stopping the run at the next
+        // checkpoint keeps them evenly spaced through long ASCII stretches.
+        if (map != NULL) {
+            uint32_t untilCheckpoint = nextCheckpoint - (transcoder->output_offset + outIndex);
+            outSpace = outSpace < untilCheckpoint ? outSpace : untilCheckpoint;
+        }
+        uint32_t run = 0;
+        if (utf16) {
+            uint32_t units = (inLength - inIndex) / 2;
+            units = units < outSpace ? units : outSpace;
+            run = CSFM_UTF16_asciiPrefix(&in[inIndex], units, encoding == CSFM_ENCODING_UTF16LE);
+            uint32_t lowByte = encoding == CSFM_ENCODING_UTF16LE ? 0 : 1;
+            for (uint32_t i = 0; i < run; i++) {
+                out[outIndex + i] = in[inIndex + i * 2 + lowByte];
+            }
+            inIndex += run * 2;
+        } else {
+            uint32_t length = inLength - inIndex;
+            length = length < outSpace ? length : outSpace;
+            run = CSFM_UTF8_asciiPrefix(&in[inIndex], length);
+            memcpy(&out[outIndex], &in[inIndex], run);
+            inIndex += run;
+        }
+        outIndex += run;
+        if (inIndex >= inLength || outIndex >= outCapacity) {
+            break;
+        }
+        if (map != NULL && transcoder->output_offset + outIndex >= nextCheckpoint) {
+            continue;
+        }
+
+        // One non-ASCII character at a time until the next ASCII run.
+        uint32_t codepoint = 0;
+        uint32_t consumed = CSFM_Encoding_decode(encoding, &in[inIndex], inLength - inIndex, &codepoint);
+        if (consumed == 0) {
+            break;
+        }
+        uint8_t scratch[4];
+        uint32_t written = CSFM_UTF8_encode(codepoint, scratch);
+        if (outIndex + written > outCapacity) {
+            break;
+        }
+        memcpy(&out[outIndex], scratch, written);
+        outIndex += written;
+        inIndex += consumed;
+    }
+
+    transcoder->input_offset += inIndex;
+    transcoder->output_offset += outIndex;
+    if (produced != NULL) {
+        *produced = outIndex;
+    }
+    return inIndex;
+}
+
+CSFM_ErrorType CSFM_TranscodeToUTF8(
+    const uint8_t *buf, uint32_t size, CSFM_Encoding encoding,
+    CSFM_String8Slice *out, CSFM_OffsetMap *map
+) {
+    if (out == NULL) {
+        return CSFM_ERROR_SUCCESS;
+    }
+    out->ptr = NULL;
+    out->length = 0;
+    CSFM_TRACE_BEGIN(transcode);
+
+    uint32_t bomLength = 0;
+    CSFM_Encoding_detect(buf, size, &bomLength);
+
+    // NOTE(mattg): Worst case is one CP1252 byte becoming 3 UTF-8 bytes.
+    uint64_t capacity = (uint64_t)(size - bomLength) * 3;
+    if (capacity > UINT32_MAX) {
+        return CSFM_ERROR_OUT_OF_MEMORY;
+    }
+    uint8_t *output = malloc(capacity > 0 ? (size_t)capacity : 1);
+    if (output == NULL) {
+        return CSFM_ERROR_OUT_OF_MEMORY;
+    }
+
+    CSFM_Transcoder transcoder;
+    CSFM_Transcoder_init(&transcoder, encoding, map);
+    // NOTE(mattg): The BOM is not part of the text, but offsets in the map are
+    // still relative to the original buffer.
+    transcoder.input_offset = bomLength;
+
+    uint32_t inIndex = bomLength;
+    uint32_t outIndex = 0;
+    while (inIndex < size) {
+        uint32_t produced = 0;
+        uint32_t consumed = CSFM_Transcoder_feed(
+            &transcoder, &buf[inIndex], size - inIndex,
+            &output[outIndex], (uint32_t)capacity - outIndex, &produced
+        );
+        inIndex += consumed;
+        outIndex += produced;
+        if (consumed == 0) {
+            // NOTE(mattg): Truncated final character, there is always room
+            // for the 3 byte replacement since it took at least 1 input byte.
+            outIndex += CSFM_UTF8_encode(0xFFFD, &output[outIndex]);
+            break;
+        }
+    }
+
+    out->ptr = output;
+    out->length = outIndex;
+    CSFM_TRACE_END(transcode, NULL, size);
+    return CSFM_ERROR_SUCCESS;
+}
+
+// NOTE(mattg): For testing purposes only
+void CSFM_Token_print(CSFM_Token token, CSFM_String8Slice str) {
+    uint32_t length = token.end - token.start;
+    char *string = (char *)&str.ptr[token.start];
+    switch (token.type) {
+    case CSFM_TOKEN_NULL:
+        printf("[NULL]\n");
+        break;
+    case CSFM_TOKEN_CR:
+        printf("[CR]\n");
+        break;
+    case CSFM_TOKEN_LF:
+        printf("[LF]\n");
+        break;
+    default:
+        printf("[%*.*s]", length, length, string);
+    }
+}
+
+// Grows `*buffer` to hold at least `needed` elements, doubling.
+static CSFM_ErrorType CSFM_reserve(void **buffer, uint32_t *capacity, uint32_t needed, uint32_t elementSize) {
+    if (needed <= *capacity) {
+        return CSFM_ERROR_SUCCESS;
+    }
+    uint32_t newCapacity = *capacity == 0 ? 64 : *capacity;
+    while (newCapacity < needed) {
+        newCapacity *= 2;
+    }
+    void *newBuffer = realloc(*buffer, (size_t)newCapacity * elementSize);
+    if (newBuffer == NULL) {
+        return CSFM_ERROR_OUT_OF_MEMORY;
+    }
+    *buffer = newBuffer;
+    *capacity = newCapacity;
+    return CSFM_ERROR_SUCCESS;
+}
+
+// Cuts a flat array back to `newCapacity` elements. Keeping the bigger
+// buffer when realloc fails is fine.
+static void CSFM_shrink(void **buffer, uint32_t *capacity, uint32_t newCapacity, uint32_t elementSize) {
+    if (*buffer == NULL || newCapacity >= *capacity) {
+        return;
+    }
+    void *newBuffer = realloc(*buffer, (size_t)newCapacity * elementSize);
+    if (newBuffer == NULL) {
+        return;
+    }
+    *buffer = newBuffer;
+    *capacity = newCapacity;
+}
+
+// NOTE(mattg): C99 has no aligned_alloc, so over-allocate and keep the
+// pointer malloc gave back in the slot right before the aligned block.
+// Blocks start out zeroed.
+static void *CSFM_allocateBlock(size_t size) {
+    uint8_t *raw = malloc(size + CSFM_CACHE_LINE + sizeof(void *));
+    if (raw == NULL) {
+        return NULL;
+    }
+    uintptr_t aligned = ((uintptr_t)raw + sizeof(void *) + CSFM_CACHE_LINE - 1) & ~(uintptr_t)(CSFM_CACHE_LINE - 1);
+    uint8_t *block = (uint8_t *)aligned;
+    memcpy(block - sizeof(void *), &raw, sizeof(void *));
+    memset(block, 0, size);
+    return block;
+}
+
+static void CSFM_freeBlock(void *block) {
+    if (block == NULL) {
+        return;
+    }
+    void *raw = NULL;
+    memcpy(&raw, (uint8_t *)block - sizeof(void *), sizeof(void *));
+    free(raw);
+}
+
+static inline uint32_t CSFM_blocksFor(uint32_t capacity) {
+    return (uint32_t)(((uint64_t)capacity + CSFM_ARRAY_BLOCK_MASK) >> CSFM_ARRAY_BLOCK_SHIFT);
+}
+
+CSFM_ErrorType CSFM_TokenArray_allocate(CSFM_TokenArray *array, uint32_t capacity) {
+    if (array == NULL) {
+        return CSFM_ERROR_SUCCESS;
+    }
+    memset(array, 0, sizeof(*array));
+    capacity = capacity <= CSFM_TOKEN_ARRAY_CAPACITY_MAX ? capacity : CSFM_TOKEN_ARRAY_CAPACITY_MAX;
+    if (capacity == 0) {
+        return CSFM_ERROR_SUCCESS;
+    }
+
+    CSFM_ErrorType error = CSFM_reserve(
+        (void **)&array->blocks, &array->directory_capacity, CSFM_blocksFor(capacity), sizeof(CSFM_Token *)
+    );
+    if (error == CSFM_ERROR_SUCCESS) {
+        error = CSFM_TokenArray_resize(array, CSFM_ARRAY_BLOCK_LENGTH);
+    }
+    if (error != CSFM_ERROR_SUCCESS) {
+        CSFM_TokenArray_deallocate(array);
+    }
+    return error;
+}
+
+void CSFM_TokenArray_deallocate(CSFM_TokenArray *array) {
+    if (array == NULL) {
+        return;
+    }
+    for (uint32_t i = 0; i < array->block_count; i++) {
+        CSFM_freeBlock(array->blocks[i]);
+    }
+    free(array->blocks);
+    memset(array, 0, sizeof(*array));
+}
+
+void CSFM_TokenArray_reuse(CSFM_TokenArray *array) {
+    if (array == NULL) {
+        return;
+    }
+    // NOTE(mattg): Everything past `length` is already zero, only the used
+    // prefix needs clearing.
+    uint32_t remaining = array->length;
+    for (uint32_t i = 0; remaining > 0; i++) {
+        uint32_t count = remaining < CSFM_ARRAY_BLOCK_LENGTH ? remaining : CSFM_ARRAY_BLOCK_LENGTH;
+        memset(array->blocks[i], 0, sizeof(CSFM_Token) * count);
+        remaining -= count;
+    }
+    array->length = 0;
+}
+
+// Frees the blocks past `newCapacity`, the directory stays.
+static void CSFM_TokenArray_shrink(CSFM_TokenArray *array, uint32_t newCapacity) {
+    if (array == NULL || array->blocks == NULL || newCapacity >= array->capacity || newCapacity < array->length) {
+        return;
+    }
+    if (newCapacity == 0) {
+        CSFM_TokenArray_deallocate(array);
+        return;
+    }
+    uint32_t blockCount = CSFM_blocksFor(newCapacity);
+    while (array->block_count > blockCount) {
+        array->block_count--;
+        CSFM_freeBlock(array->blocks[array->block_count]);
+        array->blocks[array->block_count] = NULL;
+    }
+    array->capacity = array->block_count * CSFM_ARRAY_BLOCK_LENGTH;
+}
+
+// Adds blocks until `newCapacity` fits.
+static CSFM_ErrorType CSFM_TokenArray_resize(CSFM_TokenArray *array, uint32_t newCapacity) {
+    if (array == NULL || newCapacity <= array->capacity) {
+        return CSFM_ERROR_SUCCESS;
+    }
+    newCapacity = newCapacity <= CSFM_TOKEN_ARRAY_CAPACITY_MAX ? newCapacity : CSFM_TOKEN_ARRAY_CAPACITY_MAX;
+
+    uint32_t blockCount = CSFM_blocksFor(newCapacity);
+    CSFM_ErrorType error = CSFM_reserve((void **)&array->blocks, &array->directory_capacity, blockCount, sizeof(CSFM_Token *));
+    if (error != CSFM_ERROR_SUCCESS) {
+        return error;
+    }
+    while (array->block_count < blockCount) {
+        CSFM_Token *block = CSFM_allocateBlock(sizeof(CSFM_Token) * CSFM_ARRAY_BLOCK_LENGTH);
+        if (block == NULL) {
+            return CSFM_ERROR_OUT_OF_MEMORY;
+        }
+        array->blocks[array->block_count] = block;
+        array->block_count++;
+        array->capacity += CSFM_ARRAY_BLOCK_LENGTH;
+    }
+    return CSFM_ERROR_SUCCESS;
+}
+
+static CSFM_ErrorType CSFM_TokenArray_push(CSFM_TokenArray *array, CSFM_Token token) {
+    if (array == NULL) {
+        return CSFM_ERROR_SUCCESS;
+    }
+
+    if (array->length >= array->capacity) {
+        // NOTE(mattg): One block at a time, starting from an empty array too.
+        CSFM_ErrorType err = CSFM_TokenArray_resize(array, array->capacity + CSFM_ARRAY_BLOCK_LENGTH);
+        if (err != CSFM_ERROR_SUCCESS) {
+            return err;
+        }
+        if (array->length >= array->capacity) {
+            return CSFM_ERROR_OUT_OF_MEMORY;
+        }
+    }
+
+    array->blocks[array->length >> CSFM_ARRAY_BLOCK_SHIFT][array->length & CSFM_ARRAY_BLOCK_MASK] = token;
+    array->length++;
+    return CSFM_ERROR_SUCCESS;
+}
+
+CSFM_Token CSFM_TokenArray_get(CSFM_TokenArray array, uint32_t index) {
+    if (index < array.length) {
+        return array.blocks[index >> CSFM_ARRAY_BLOCK_SHIFT][index & CSFM_ARRAY_BLOCK_MASK];
+    }
+    CSFM_Token stub = {0};
+    return stub;
+}
+
+CSFM_ErrorType CSFM_TokenArray_export(const CSFM_TokenArray *array, CSFM_Token **out) {
+    if (out == NULL) {
+        return CSFM_ERROR_SUCCESS;
+    }
+    *out = NULL;
+    if (array == NULL || array->length == 0) {
+        return CSFM_ERROR_SUCCESS;
+    }
+    CSFM_Token *buffer = malloc(sizeof(CSFM_Token) * (size_t)array->length);
+    if (buffer == NULL) {
+        return CSFM_ERROR_OUT_OF_MEMORY;
+    }
+    for (uint32_t start = 0; start < array->length; start += CSFM_ARRAY_BLOCK_LENGTH) {
+        uint32_t count = array->length - start < CSFM_ARRAY_BLOCK_LENGTH ? array->length - start : CSFM_ARRAY_BLOCK_LENGTH;
+        memcpy(&buffer[start], array->blocks[start >> CSFM_ARRAY_BLOCK_SHIFT], sizeof(CSFM_Token) * count);
+    }
+    *out = buffer;
+    return CSFM_ERROR_SUCCESS;
+}
+
+// NOTE(mattg): Byte -> token type, one entry per byte value. Anything that is
+// not punctuation the tokenizer cares about, including every byte >= 0x80, is
+// TEXT. Abbreviations are only to keep the grid readable.
+#define N_ CSFM_TOKEN_NULL
+#define T_ CSFM_TOKEN_TEXT
+#define WS CSFM_TOKEN_WS
+#define CR CSFM_TOKEN_CR
+#define LF CSFM_TOKEN_LF
+#define D_ CSFM_TOKEN_NUMBER
+static const uint8_t CSFM_TOKEN_CLASS[256] = {
+/*         0   1   2   3   4   5   6   7   8   9   A   B   C   D   E   F */
+/* 0x00 */ N_, T_, T_, T_, T_, T_, T_, T_, T_, WS, LF, T_, T_, CR, T_, T_,
+/* 0x10 */ T_, T_, T_, T_, T_, T_, T_, T_, T_, T_, T_, T_, T_, T_, T_, T_,
+/* 0x20 */ WS, T_, CSFM_TOKEN_DOUBLE_QUOTE, T_, T_, T_, T_, T_,
+           T_, T_, CSFM_TOKEN_ASTERISK, CSFM_TOKEN_PLUS, CSFM_TOKEN_COMMA, CSFM_TOKEN_MINUS, CSFM_TOKEN_PERIOD, CSFM_TOKEN_FORWARDSLASH,
+/* 0x30 */ D_, D_, D_, D_, D_, D_, D_, D_, D_, D_, CSFM_TOKEN_COLON, CSFM_TOKEN_SEMICOLON, T_, CSFM_TOKEN_EQUAL, T_, T_,
+/* 0x40 */ T_, T_, T_, T_, T_, T_, T_, T_, T_, T_, T_, T_, T_, T_, T_, T_,
+/* 0x50 */ T_, T_, T_, T_, T_, T_, T_, T_, T_, T_, T_, T_, CSFM_TOKEN_BACKSLASH, T_, T_, T_,
+/* 0x60 */ T_, T_, T_, T_, T_, T_, T_, T_, T_, T_, T_, T_, T_, T_, T_, T_,
+/* 0x70 */ T_, T_, T_, T_, T_, T_, T_, T_, T_, T_, T_, T_, CSFM_TOKEN_PIPE, T_, CSFM_TOKEN_TILDE, T_,
+/* 0x80 */ T_, T_, T_, T_, T_, T_, T_, T_, T_, T_, T_, T_, T_, T_, T_, T_,
+/* 0x90 */ T_, T_, T_, T_, T_, T_, T_, T_, T_, T_, T_, T_, T_, T_, T_, T_,
+/* 0xA0 */ T_, T_, T_, T_, T_, T_, T_, T_, T_, T_, T_, T_, T_, T_, T_, T_,
+/* 0xB0 */ T_, T_, T_, T_, T_, T_, T_, T_, T_, T_, T_, T_, T_, T_, T_, T_,
+/* 0xC0 */ T_, T_, T_, T_, T_, T_, T_, T_, T_, T_, T_, T_, T_, T_, T_, T_,
+/* 0xD0 */ T_, T_, T_, T_, T_, T_, T_, T_, T_, T_, T_, T_, T_, T_, T_, T_,
+/* 0xE0 */ T_, T_, T_, T_, T_, T_, T_, T_, T_, T_, T_, T_, T_, T_, T_, T_,
+/* 0xF0 */ T_, T_, T_, T_, T_, T_, T_, T_, T_, T_, T_, T_, T_, T_, T_, T_,
+};
+#undef N_
+#undef T_
+#undef WS
+#undef CR
+#undef LF
+#undef D_
+
+static inline CSFM_TokenType peekTokenType(CSFM_String8Slice str, uint32_t index) {
+    if (index >= str.length) {
+        return CSFM_TOKEN_NULL;
+    }
+    return (CSFM_TokenType)CSFM_TOKEN_CLASS[str.ptr[index]];
+}
+
+// NOTE(mattg): SWAR helpers, 8 bytes per 64-bit word. They are only exact for
+// lanes below 0x80, callers deal with the high lanes themselves.
+#define CSFM_SWAR_ONES 0x0101010101010101ULL
+#define CSFM_SWAR_HIGH 0x8080808080808080ULL
+
+// High bit set in every lane that is >= `n` (n <= 0x80).
+static inline uint64_t CSFM_SWAR_atLeast(uint64_t lanes, uint32_t n) {
+    return ((lanes | CSFM_SWAR_HIGH) - CSFM_SWAR_ONES * n) & CSFM_SWAR_HIGH;
+}
+
+// High bit set in every lane within [low, high].
+static inline uint64_t CSFM_SWAR_between(uint64_t lanes, uint32_t low, uint32_t high) {
+    return CSFM_SWAR_atLeast(lanes, low) & ~CSFM_SWAR_atLeast(lanes, high + 1);
+}
+
+static inline uint64_t CSFM_SWAR_equal(uint64_t lanes, uint32_t value) {
+    return CSFM_SWAR_between(lanes, value, value);
+}
+
+// Index of the first lane (in memory order) with its high bit set.
+static inline uint32_t CSFM_SWAR_firstLane(uint64_t mask) {
+#if defined(__GNUC__) || defined(__clang__)
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+    return (uint32_t)__builtin_clzll(mask) >> 3;
+#else
+    return (uint32_t)__builtin_ctzll(mask) >> 3;
+#endif
+#else
+    uint8_t bytes[8];
+    memcpy(bytes, &mask, sizeof(bytes));
+    uint32_t lane = 0;
+    while ((bytes[lane] & 0x80) == 0) {
+        lane++;
+    }
+    return lane;
+#endif
+}
+
+// Marks every lane that may end a run of `type`. Exact for WS and NUMBER. For
+// TEXT, control characters are flagged too and have to be checked against
+// the class table.
+static inline uint64_t CSFM_SWAR_runStops(uint64_t chunk, CSFM_TokenType type) {
+    uint64_t high = chunk & CSFM_SWAR_HIGH;
+    uint64_t lanes = chunk & ~CSFM_SWAR_HIGH;
+    uint64_t stops = 0;
+    switch (type) {
+    case CSFM_TOKEN_WS:
+        stops = ~(CSFM_SWAR_equal(lanes, ' ') | CSFM_SWAR_equal(lanes, '\t')) & CSFM_SWAR_HIGH;
+        stops |= high;
+        break;
+    case CSFM_TOKEN_NUMBER:
+        stops = ~CSFM_SWAR_between(lanes, '0', '9') & CSFM_SWAR_HIGH;
+        stops |= high;
+        break;
+    default:
+        // NOTE(mattg): '*' through ';' is one contiguous block: * + , - . / 0-9 : ;
+        stops = (~CSFM_SWAR_atLeast(lanes, '!') & CSFM_SWAR_HIGH) |
+            CSFM_SWAR_equal(lanes, '"') |
+            CSFM_SWAR_between(lanes, '*', ';') |
+            CSFM_SWAR_equal(lanes, '=') |
+            CSFM_SWAR_equal(lanes, '\\') |
+            CSFM_SWAR_equal(lanes, '|') |
+            CSFM_SWAR_equal(lanes, '~');
+        stops &= ~high;
+        break;
+    }
+    return stops;
+}
+
+// Returns the end of the run of `type` that continues at `index`.
+static inline uint32_t scanRun(CSFM_String8Slice str, uint32_t index, CSFM_TokenType type) {
+    while (index + 8 <= str.length) {
+        uint64_t chunk;
+        memcpy(&chunk, &str.ptr[index], sizeof(chunk));
+        uint64_t stops = CSFM_SWAR_runStops(chunk, type);
+        if (stops == 0) {
+            index += 8;
+            continue;
+        }
+        index += CSFM_SWAR_firstLane(stops);
+        if (CSFM_TOKEN_CLASS[str.ptr[index]] != type) {
+            return index;
+        }
+        index++;
+    }
+    while (index < str.length && CSFM_TOKEN_CLASS[str.ptr[index]] == type) {
+        index++;
+    }
+    return index;
+}
+
+static inline CSFM_Token peekToken(CSFM_String8Slice str, uint32_t index) {
+    CSFM_Token token = {0};
+    token.start = index;
+    token.type = peekTokenType(str, index);
+    switch (token.type) {
+    // NOTE(mattg): These are 1 character tokens
+    case CSFM_TOKEN_NULL:
+    case CSFM_TOKEN_CR:
     case CSFM_TOKEN_LF:
     case CSFM_TOKEN_FORWARDSLASH:
     case CSFM_TOKEN_BACKSLASH:
@@ -548,11 +1852,7 @@ static inline CSFM_Token peekToken(CSFM_String8Slice str, uint32_t index) {
     case CSFM_TOKEN_WS:
     case CSFM_TOKEN_NUMBER:
     case CSFM_TOKEN_TEXT:
-        type = token.type;
-        do {
-            type = peekTokenType(str, ++index);
-        } while (type == token.type && index < str.length);
-        token.end = index;
+        token.end = scanRun(str, index + 1, token.type);
     }
     return token;
 }
@@ -564,32 +1864,55 @@ static inline CSFM_Token consumeToken(CSFM_String8Slice str, uint32_t *index) {
 }
 
 CSFM_TokenResult CSFM_TokenizeAll(uint8_t *buf, uint32_t size) {
-    CSFM_TokenResult result = {
-        .input = {
-            .ptr = buf,
-            .length = size,
-        },
-    };
-    if (CSFM_TokenArray_allocate(&result.tokens, size) != CSFM_ERROR_SUCCESS) {
-        return result;
-    }
+    CSFM_Options options = {0};
+    return CSFM_TokenizeAllWithOptions(buf, size, options);
+}
 
+// Tokenizes `result->input` into `result->tokens`, which must already have
+// some capacity.
+static void CSFM_tokenizeInto(CSFM_TokenResult *result, CSFM_Options options) {
+    CSFM_TRACE_BEGIN(tokenize);
+    bool validate = (options.flags & CSFM_OPTION_VALIDATE_UTF8) != 0;
+    uint32_t validated = 0;
     uint32_t tokenIndex = 0;
     CSFM_Token token = {0};
     do {
-        token = consumeToken(result.input, &tokenIndex);
+        token = consumeToken(result->input, &tokenIndex);
         if (token.type == CSFM_TOKEN_NULL) {
             break;
         }
-        if (CSFM_TokenArray_push(&result.tokens, token) != CSFM_ERROR_SUCCESS) {
+        if (validate && !CSFM_UTF8_validateBehind(result->input, &validated, tokenIndex, false, &result->error_offset)) {
+            result->error = CSFM_ERROR_INVALID_UTF8;
+            validate = false;
+        }
+        if (CSFM_TokenArray_push(&result->tokens, token) != CSFM_ERROR_SUCCESS) {
+            result->error = CSFM_ERROR_OUT_OF_MEMORY;
             break;
         }
     } while (
         token.type != CSFM_TOKEN_NULL &&
-        tokenIndex < result.input.length &&
-        result.tokens.length < CSFM_TOKEN_ARRAY_CAPACITY_MAX
+        tokenIndex < result->input.length &&
+        result->tokens.length < CSFM_TOKEN_ARRAY_CAPACITY_MAX
     );
 
+    if (validate && !CSFM_UTF8_validateBehind(result->input, &validated, tokenIndex, true, &result->error_offset)) {
+        result->error = CSFM_ERROR_INVALID_UTF8;
+    }
+    CSFM_TRACE_END(tokenize, NULL, result->input.length);
+}
+
+CSFM_TokenResult CSFM_TokenizeAllWithOptions(uint8_t *buf, uint32_t size, CSFM_Options options) {
+    CSFM_TokenResult result = {
+        .input = {
+            .ptr = buf,
+            .length = size,
+        },
+    };
+    result.error = CSFM_TokenArray_allocate(&result.tokens, size);
+    if (result.error != CSFM_ERROR_SUCCESS) {
+        return result;
+    }
+    CSFM_tokenizeInto(&result, options);
     return result;
 }
 
@@ -613,109 +1936,543 @@ CSFM_ErrorType CSFM_NodeArray_allocate(CSFM_NodeArray *array, uint32_t capacity)
     if (array == NULL) {
         return CSFM_ERROR_SUCCESS;
     }
+    memset(array, 0, sizeof(*array));
     capacity = capacity <= CSFM_NODE_ARRAY_CAPACITY_MAX ? capacity : CSFM_NODE_ARRAY_CAPACITY_MAX;
-    
     if (capacity == 0) {
-        array->buffer = NULL;
-        array->capacity = 0;
-        array->length = 0;
         return CSFM_ERROR_SUCCESS;
     }
 
-    uint32_t size = sizeof(CSFM_Node) * capacity;
-    array->buffer = malloc(size);
-    if (array->buffer == NULL) {
-        array->capacity = 0;
-        array->length = 0;
-        return CSFM_ERROR_OUT_OF_MEMORY;
+    CSFM_ErrorType error = CSFM_reserve(
+        (void **)&array->blocks, &array->directory_capacity, CSFM_blocksFor(capacity), sizeof(CSFM_Node *)
+    );
+    if (error == CSFM_ERROR_SUCCESS) {
+        error = CSFM_NodeArray_resize(array, CSFM_ARRAY_BLOCK_LENGTH);
     }
-    memset(array->buffer, 0, size);
-    array->capacity = capacity;
-    array->length = 0;
-    return CSFM_ERROR_SUCCESS;
+    if (error != CSFM_ERROR_SUCCESS) {
+        CSFM_NodeArray_deallocate(array);
+    }
+    return error;
 }
 
 void CSFM_NodeArray_deallocate(CSFM_NodeArray *array) {
     if (array == NULL) {
         return;
     }
-    if (array->buffer != NULL) {
-        free(array->buffer);
-        array->buffer = NULL;
+    for (uint32_t i = 0; i < array->block_count; i++) {
+        CSFM_freeBlock(array->blocks[i]);
     }
-    array->capacity = 0;
-    array->length = 0;
+    free(array->blocks);
+    memset(array, 0, sizeof(*array));
 }
 
 void CSFM_NodeArray_reuse(CSFM_NodeArray *array) {
     if (array == NULL) {
         return;
     }
-    if (array->buffer != NULL) {
-        uint32_t size = sizeof(CSFM_Node) * array->capacity;
-        memset(array->buffer, 0, size);
+    // NOTE(mattg): Everything past `length` is already zero (pop clears the
+    // slot it gives back), only the used prefix needs clearing.
+    uint32_t remaining = array->length;
+    for (uint32_t i = 0; remaining > 0; i++) {
+        uint32_t count = remaining < CSFM_ARRAY_BLOCK_LENGTH ? remaining : CSFM_ARRAY_BLOCK_LENGTH;
+        memset(array->blocks[i], 0, sizeof(CSFM_Node) * count);
+        remaining -= count;
     }
     array->length = 0;
 }
 
-static CSFM_ErrorType CSFM_NodeArray_resize(CSFM_NodeArray *array, uint32_t newCapacity) {
-    if (array == NULL || newCapacity <= array->capacity) {
-        return CSFM_ERROR_SUCCESS;
+// Frees the blocks past `newCapacity`, the directory stays.
+static void CSFM_NodeArray_shrink(CSFM_NodeArray *array, uint32_t newCapacity) {
+    if (array == NULL || array->blocks == NULL || newCapacity >= array->capacity || newCapacity < array->length) {
+        return;
     }
-    newCapacity = newCapacity <= CSFM_NODE_ARRAY_CAPACITY_MAX ? newCapacity : CSFM_NODE_ARRAY_CAPACITY_MAX;
-
-    {
-        uint32_t newSize = sizeof(CSFM_Node) * newCapacity;
-        CSFM_Node *newBuffer = realloc(array->buffer, newSize);
-        if (newBuffer == NULL) {
+    if (newCapacity == 0) {
+        CSFM_NodeArray_deallocate(array);
+        return;
+    }
+    uint32_t blockCount = CSFM_blocksFor(newCapacity);
+    while (array->block_count > blockCount) {
+        array->block_count--;
+        CSFM_freeBlock(array->blocks[array->block_count]);
+        array->blocks[array->block_count] = NULL;
+    }
+    array->capacity = array->block_count * CSFM_ARRAY_BLOCK_LENGTH;
+}
+
+// Adds blocks until `newCapacity` fits.
+static CSFM_ErrorType CSFM_NodeArray_resize(CSFM_NodeArray *array, uint32_t newCapacity) {
+    if (array == NULL || newCapacity <= array->capacity) {
+        return CSFM_ERROR_SUCCESS;
+    }
+    newCapacity = newCapacity <= CSFM_NODE_ARRAY_CAPACITY_MAX ? newCapacity : CSFM_NODE_ARRAY_CAPACITY_MAX;
+
+    uint32_t blockCount = CSFM_blocksFor(newCapacity);
+    CSFM_ErrorType error = CSFM_reserve((void **)&array->blocks, &array->directory_capacity, blockCount, sizeof(CSFM_Node *));
+    if (error != CSFM_ERROR_SUCCESS) {
+        return error;
+    }
+    while (array->block_count < blockCount) {
+        CSFM_Node *block = CSFM_allocateBlock(sizeof(CSFM_Node) * CSFM_ARRAY_BLOCK_LENGTH);
+        if (block == NULL) {
             return CSFM_ERROR_OUT_OF_MEMORY;
         }
-        array->buffer = newBuffer;
+        array->blocks[array->block_count] = block;
+        array->block_count++;
+        array->capacity += CSFM_ARRAY_BLOCK_LENGTH;
     }
-    uint32_t capacityDifference = newCapacity - array->capacity;
-    uint32_t addedSize = sizeof(CSFM_Node) * capacityDifference;
-    if (addedSize > 0) {
-        memset(&array->buffer[array->capacity], 0, addedSize);
-    }
-    array->capacity = newCapacity;
     return CSFM_ERROR_SUCCESS;
 }
 
 static CSFM_ErrorType CSFM_NodeArray_push(CSFM_NodeArray *array, CSFM_Node node) {
-    if (array == NULL || array->buffer == NULL) {
+    if (array == NULL) {
         return CSFM_ERROR_SUCCESS;
     }
+
     if (array->length >= array->capacity) {
-        CSFM_ErrorType err = CSFM_NodeArray_resize(array, array->capacity * 2);
+        CSFM_ErrorType err = CSFM_NodeArray_resize(array, array->capacity + CSFM_ARRAY_BLOCK_LENGTH);
         if (err != CSFM_ERROR_SUCCESS) {
             return err;
         }
+        if (array->length >= array->capacity) {
+            return CSFM_ERROR_OUT_OF_MEMORY;
+        }
     }
 
-    array->buffer[array->length] = node;
+    *CSFM_NodeArray_at(array, array->length) = node;
     array->length++;
     return CSFM_ERROR_SUCCESS;
 }
 
+static inline CSFM_Node *CSFM_NodeArray_at(const CSFM_NodeArray *array, uint32_t index) {
+    return &array->blocks[index >> CSFM_ARRAY_BLOCK_SHIFT][index & CSFM_ARRAY_BLOCK_MASK];
+}
+
 static void CSFM_NodeArray_pop(CSFM_NodeArray *array) {
-    if (array == NULL || array->buffer == NULL) {
+    if (array == NULL) {
         return;
     }
     if (array->length > 0) {
         array->length--;
+        memset(CSFM_NodeArray_at(array, array->length), 0, sizeof(CSFM_Node));
     }
 }
 
 CSFM_Node CSFM_NodeArray_get(CSFM_NodeArray array, uint32_t index) {
+    if (index < array.length) {
+        return *CSFM_NodeArray_at(&array, index);
+    }
+    CSFM_Node stub = {0};
+    return stub;
+}
+
+CSFM_ErrorType CSFM_NodeArray_export(const CSFM_NodeArray *array, CSFM_Node **out) {
+    if (out == NULL) {
+        return CSFM_ERROR_SUCCESS;
+    }
+    *out = NULL;
+    if (array == NULL || array->length == 0) {
+        return CSFM_ERROR_SUCCESS;
+    }
+    CSFM_Node *buffer = malloc(sizeof(CSFM_Node) * (size_t)array->length);
+    if (buffer == NULL) {
+        return CSFM_ERROR_OUT_OF_MEMORY;
+    }
+    for (uint32_t start = 0; start < array->length; start += CSFM_ARRAY_BLOCK_LENGTH) {
+        uint32_t count = array->length - start < CSFM_ARRAY_BLOCK_LENGTH ? array->length - start : CSFM_ARRAY_BLOCK_LENGTH;
+        memcpy(&buffer[start], array->blocks[start >> CSFM_ARRAY_BLOCK_SHIFT], sizeof(CSFM_Node) * count);
+    }
+    *out = buffer;
+    return CSFM_ERROR_SUCCESS;
+}
+
+// Makes `to` an independent copy of `from`, allocating only the blocks the
+// nodes need.
+static CSFM_ErrorType CSFM_NodeArray_copy(CSFM_NodeArray *to, const CSFM_NodeArray *from) {
+    CSFM_ErrorType error = CSFM_NodeArray_allocate(to, from->length);
+    if (error == CSFM_ERROR_SUCCESS) {
+        error = CSFM_NodeArray_resize(to, from->length);
+    }
+    if (error != CSFM_ERROR_SUCCESS) {
+        CSFM_NodeArray_deallocate(to);
+        return error;
+    }
+    for (uint32_t start = 0; start < from->length; start += CSFM_ARRAY_BLOCK_LENGTH) {
+        uint32_t count = from->length - start < CSFM_ARRAY_BLOCK_LENGTH ? from->length - start : CSFM_ARRAY_BLOCK_LENGTH;
+        memcpy(to->blocks[start >> CSFM_ARRAY_BLOCK_SHIFT], from->blocks[start >> CSFM_ARRAY_BLOCK_SHIFT], sizeof(CSFM_Node) * count);
+    }
+    to->length = from->length;
+    return CSFM_ERROR_SUCCESS;
+}
+
+typedef struct {
+    const char *name;
+    CSFM_MarkerKind kind;
+} CSFM_MarkerInfo;
+
+static const CSFM_MarkerInfo CSFM_MARKER_INFO[CSFM_MARKER_COUNT] = {
+    [CSFM_MARKER_id] = {"id", CSFM_MARKER_KIND_HEADER},
+    [CSFM_MARKER_usfm] = {"usfm", CSFM_MARKER_KIND_HEADER},
+    [CSFM_MARKER_ide] = {"ide", CSFM_MARKER_KIND_HEADER},
+    [CSFM_MARKER_sts] = {"sts", CSFM_MARKER_KIND_HEADER},
+    [CSFM_MARKER_rem] = {"rem", CSFM_MARKER_KIND_HEADER},
+    [CSFM_MARKER_h] = {"h", CSFM_MARKER_KIND_HEADER},
+    [CSFM_MARKER_toc] = {"toc", CSFM_MARKER_KIND_HEADER},
+    [CSFM_MARKER_toca] = {"toca", CSFM_MARKER_KIND_HEADER},
+    [CSFM_MARKER_imt] = {"imt", CSFM_MARKER_KIND_PARAGRAPH},
+    [CSFM_MARKER_is] = {"is", CSFM_MARKER_KIND_PARAGRAPH},
+    [CSFM_MARKER_ip] = {"ip", CSFM_MARKER_KIND_PARAGRAPH},
+    [CSFM_MARKER_ipi] = {"ipi", CSFM_MARKER_KIND_PARAGRAPH},
+    [CSFM_MARKER_im] = {"im", CSFM_MARKER_KIND_PARAGRAPH},
+    [CSFM_MARKER_imi] = {"imi", CSFM_MARKER_KIND_PARAGRAPH},
+    [CSFM_MARKER_ipq] = {"ipq", CSFM_MARKER_KIND_PARAGRAPH},
+    [CSFM_MARKER_imq] = {"imq", CSFM_MARKER_KIND_PARAGRAPH},
+    [CSFM_MARKER_iq] = {"iq", CSFM_MARKER_KIND_PARAGRAPH},
+    [CSFM_MARKER_ib] = {"ib", CSFM_MARKER_KIND_PARAGRAPH},
+    [CSFM_MARKER_ili] = {"ili", CSFM_MARKER_KIND_PARAGRAPH},
+    [CSFM_MARKER_iot] = {"iot", CSFM_MARKER_KIND_PARAGRAPH},
+    [CSFM_MARKER_io] = {"io", CSFM_MARKER_KIND_PARAGRAPH},
+    [CSFM_MARKER_ior] = {"ior", CSFM_MARKER_KIND_CHARACTER},
+    [CSFM_MARKER_iqt] = {"iqt", CSFM_MARKER_KIND_CHARACTER},
+    [CSFM_MARKER_iex] = {"iex", CSFM_MARKER_KIND_PARAGRAPH},
+    [CSFM_MARKER_imte] = {"imte", CSFM_MARKER_KIND_PARAGRAPH},
+    [CSFM_MARKER_ie] = {"ie", CSFM_MARKER_KIND_PARAGRAPH},
+    [CSFM_MARKER_mt] = {"mt", CSFM_MARKER_KIND_PARAGRAPH},
+    [CSFM_MARKER_mte] = {"mte", CSFM_MARKER_KIND_PARAGRAPH},
+    [CSFM_MARKER_ms] = {"ms", CSFM_MARKER_KIND_PARAGRAPH},
+    [CSFM_MARKER_mr] = {"mr", CSFM_MARKER_KIND_PARAGRAPH},
+    [CSFM_MARKER_s] = {"s", CSFM_MARKER_KIND_PARAGRAPH},
+    [CSFM_MARKER_sr] = {"sr", CSFM_MARKER_KIND_PARAGRAPH},
+    [CSFM_MARKER_r] = {"r", CSFM_MARKER_KIND_PARAGRAPH},
+    [CSFM_MARKER_rq] = {"rq", CSFM_MARKER_KIND_CHARACTER},
+    [CSFM_MARKER_d] = {"d", CSFM_MARKER_KIND_PARAGRAPH},
+    [CSFM_MARKER_sp] = {"sp", CSFM_MARKER_KIND_PARAGRAPH},
+    [CSFM_MARKER_sd] = {"sd", CSFM_MARKER_KIND_PARAGRAPH},
+    [CSFM_MARKER_c] = {"c", CSFM_MARKER_KIND_CHAPTER},
+    [CSFM_MARKER_ca] = {"ca", CSFM_MARKER_KIND_CHARACTER},
+    [CSFM_MARKER_cl] = {"cl", CSFM_MARKER_KIND_PARAGRAPH},
+    [CSFM_MARKER_cp] = {"cp", CSFM_MARKER_KIND_PARAGRAPH},
+    [CSFM_MARKER_cd] = {"cd", CSFM_MARKER_KIND_PARAGRAPH},
+    [CSFM_MARKER_v] = {"v", CSFM_MARKER_KIND_VERSE},
+    [CSFM_MARKER_va] = {"va", CSFM_MARKER_KIND_CHARACTER},
+    [CSFM_MARKER_vp] = {"vp", CSFM_MARKER_KIND_CHARACTER},
+    [CSFM_MARKER_p] = {"p", CSFM_MARKER_KIND_PARAGRAPH},
+    [CSFM_MARKER_m] = {"m", CSFM_MARKER_KIND_PARAGRAPH},
+    [CSFM_MARKER_po] = {"po", CSFM_MARKER_KIND_PARAGRAPH},
+    [CSFM_MARKER_pr] = {"pr", CSFM_MARKER_KIND_PARAGRAPH},
+    [CSFM_MARKER_cls] = {"cls", CSFM_MARKER_KIND_PARAGRAPH},
+    [CSFM_MARKER_pmo] = {"pmo", CSFM_MARKER_KIND_PARAGRAPH},
+    [CSFM_MARKER_pm] = {"pm", CSFM_MARKER_KIND_PARAGRAPH},
+    [CSFM_MARKER_pmc] = {"pmc", CSFM_MARKER_KIND_PARAGRAPH},
+    [CSFM_MARKER_pmr] = {"pmr", CSFM_MARKER_KIND_PARAGRAPH},
+    [CSFM_MARKER_pi] = {"pi", CSFM_MARKER_KIND_PARAGRAPH},
+    [CSFM_MARKER_mi] = {"mi", CSFM_MARKER_KIND_PARAGRAPH},
+    [CSFM_MARKER_nb] = {"nb", CSFM_MARKER_KIND_PARAGRAPH},
+    [CSFM_MARKER_pc] = {"pc", CSFM_MARKER_KIND_PARAGRAPH},
+    [CSFM_MARKER_ph] = {"ph", CSFM_MARKER_KIND_PARAGRAPH},
+    [CSFM_MARKER_b] = {"b", CSFM_MARKER_KIND_PARAGRAPH},
+    [CSFM_MARKER_q] = {"q", CSFM_MARKER_KIND_PARAGRAPH},
+    [CSFM_MARKER_qr] = {"qr", CSFM_MARKER_KIND_PARAGRAPH},
+    [CSFM_MARKER_qc] = {"qc", CSFM_MARKER_KIND_PARAGRAPH},
+    [CSFM_MARKER_qs] = {"qs", CSFM_MARKER_KIND_CHARACTER},
+    [CSFM_MARKER_qa] = {"qa", CSFM_MARKER_KIND_PARAGRAPH},
+    [CSFM_MARKER_qac] = {"qac", CSFM_MARKER_KIND_CHARACTER},
+    [CSFM_MARKER_qm] = {"qm", CSFM_MARKER_KIND_PARAGRAPH},
+    [CSFM_MARKER_qd] = {"qd", CSFM_MARKER_KIND_PARAGRAPH},
+    [CSFM_MARKER_lh] = {"lh", CSFM_MARKER_KIND_PARAGRAPH},
+    [CSFM_MARKER_li] = {"li", CSFM_MARKER_KIND_PARAGRAPH},
+    [CSFM_MARKER_lf] = {"lf", CSFM_MARKER_KIND_PARAGRAPH},
+    [CSFM_MARKER_lim] = {"lim", CSFM_MARKER_KIND_PARAGRAPH},
+    [CSFM_MARKER_litl] = {"litl", CSFM_MARKER_KIND_CHARACTER},
+    [CSFM_MARKER_lik] = {"lik", CSFM_MARKER_KIND_CHARACTER},
+    [CSFM_MARKER_liv] = {"liv", CSFM_MARKER_KIND_CHARACTER},
+    [CSFM_MARKER_tr] = {"tr", CSFM_MARKER_KIND_PARAGRAPH},
+    [CSFM_MARKER_th] = {"th", CSFM_MARKER_KIND_CHARACTER},
+    [CSFM_MARKER_thr] = {"thr", CSFM_MARKER_KIND_CHARACTER},
+    [CSFM_MARKER_tc] = {"tc", CSFM_MARKER_KIND_CHARACTER},
+    [CSFM_MARKER_tcr] = {"tcr", CSFM_MARKER_KIND_CHARACTER},
+    [CSFM_MARKER_f] = {"f", CSFM_MARKER_KIND_NOTE},
+    [CSFM_MARKER_fe] = {"fe", CSFM_MARKER_KIND_NOTE},
+    [CSFM_MARKER_fr] = {"fr", CSFM_MARKER_KIND_NOTE_CHARACTER},
+    [CSFM_MARKER_fq] = {"fq", CSFM_MARKER_KIND_NOTE_CHARACTER},
+    [CSFM_MARKER_fqa] = {"fqa", CSFM_MARKER_KIND_NOTE_CHARACTER},
+    [CSFM_MARKER_fk] = {"fk", CSFM_MARKER_KIND_NOTE_CHARACTER},
+    [CSFM_MARKER_fl] = {"fl", CSFM_MARKER_KIND_NOTE_CHARACTER},
+    [CSFM_MARKER_fw] = {"fw", CSFM_MARKER_KIND_NOTE_CHARACTER},
+    [CSFM_MARKER_fp] = {"fp", CSFM_MARKER_KIND_NOTE_CHARACTER},
+    [CSFM_MARKER_fv] = {"fv", CSFM_MARKER_KIND_NOTE_CHARACTER},
+    [CSFM_MARKER_ft] = {"ft", CSFM_MARKER_KIND_NOTE_CHARACTER},
+    [CSFM_MARKER_fdc] = {"fdc", CSFM_MARKER_KIND_NOTE_CHARACTER},
+    [CSFM_MARKER_fm] = {"fm", CSFM_MARKER_KIND_CHARACTER},
+    [CSFM_MARKER_x] = {"x", CSFM_MARKER_KIND_NOTE},
+    [CSFM_MARKER_xo] = {"xo", CSFM_MARKER_KIND_NOTE_CHARACTER},
+    [CSFM_MARKER_xk] = {"xk", CSFM_MARKER_KIND_NOTE_CHARACTER},
+    [CSFM_MARKER_xq] = {"xq", CSFM_MARKER_KIND_NOTE_CHARACTER},
+    [CSFM_MARKER_xt] = {"xt", CSFM_MARKER_KIND_NOTE_CHARACTER},
+    [CSFM_MARKER_xta] = {"xta", CSFM_MARKER_KIND_NOTE_CHARACTER},
+    [CSFM_MARKER_xop] = {"xop", CSFM_MARKER_KIND_NOTE_CHARACTER},
+    [CSFM_MARKER_xot] = {"xot", CSFM_MARKER_KIND_NOTE_CHARACTER},
+    [CSFM_MARKER_xnt] = {"xnt", CSFM_MARKER_KIND_NOTE_CHARACTER},
+    [CSFM_MARKER_xdc] = {"xdc", CSFM_MARKER_KIND_NOTE_CHARACTER},
+    [CSFM_MARKER_add] = {"add", CSFM_MARKER_KIND_CHARACTER},
+    [CSFM_MARKER_bk] = {"bk", CSFM_MARKER_KIND_CHARACTER},
+    [CSFM_MARKER_dc] = {"dc", CSFM_MARKER_KIND_CHARACTER},
+    [CSFM_MARKER_k] = {"k", CSFM_MARKER_KIND_CHARACTER},
+    [CSFM_MARKER_lit] = {"lit", CSFM_MARKER_KIND_PARAGRAPH},
+    [CSFM_MARKER_nd] = {"nd", CSFM_MARKER_KIND_CHARACTER},
+    [CSFM_MARKER_ord] = {"ord", CSFM_MARKER_KIND_CHARACTER},
+    [CSFM_MARKER_pn] = {"pn", CSFM_MARKER_KIND_CHARACTER},
+    [CSFM_MARKER_png] = {"png", CSFM_MARKER_KIND_CHARACTER},
+    [CSFM_MARKER_addpn] = {"addpn", CSFM_MARKER_KIND_CHARACTER},
+    [CSFM_MARKER_qt] = {"qt", CSFM_MARKER_KIND_CHARACTER},
+    [CSFM_MARKER_sig] = {"sig", CSFM_MARKER_KIND_CHARACTER},
+    [CSFM_MARKER_sls] = {"sls", CSFM_MARKER_KIND_CHARACTER},
+    [CSFM_MARKER_tl] = {"tl", CSFM_MARKER_KIND_CHARACTER},
+    [CSFM_MARKER_wj] = {"wj", CSFM_MARKER_KIND_CHARACTER},
+    [CSFM_MARKER_em] = {"em", CSFM_MARKER_KIND_CHARACTER},
+    [CSFM_MARKER_bd] = {"bd", CSFM_MARKER_KIND_CHARACTER},
+    [CSFM_MARKER_it] = {"it", CSFM_MARKER_KIND_CHARACTER},
+    [CSFM_MARKER_bdit] = {"bdit", CSFM_MARKER_KIND_CHARACTER},
+    [CSFM_MARKER_no] = {"no", CSFM_MARKER_KIND_CHARACTER},
+    [CSFM_MARKER_sc] = {"sc", CSFM_MARKER_KIND_CHARACTER},
+    [CSFM_MARKER_sup] = {"sup", CSFM_MARKER_KIND_CHARACTER},
+    [CSFM_MARKER_pb] = {"pb", CSFM_MARKER_KIND_PARAGRAPH},
+    [CSFM_MARKER_fig] = {"fig", CSFM_MARKER_KIND_CHARACTER},
+    [CSFM_MARKER_ndx] = {"ndx", CSFM_MARKER_KIND_CHARACTER},
+    [CSFM_MARKER_rb] = {"rb", CSFM_MARKER_KIND_CHARACTER},
+    [CSFM_MARKER_pro] = {"pro", CSFM_MARKER_KIND_CHARACTER},
+    [CSFM_MARKER_w] = {"w", CSFM_MARKER_KIND_CHARACTER},
+    [CSFM_MARKER_wg] = {"wg", CSFM_MARKER_KIND_CHARACTER},
+    [CSFM_MARKER_wh] = {"wh", CSFM_MARKER_KIND_CHARACTER},
+    [CSFM_MARKER_wa] = {"wa", CSFM_MARKER_KIND_CHARACTER},
+    [CSFM_MARKER_jmp] = {"jmp", CSFM_MARKER_KIND_CHARACTER},
+    [CSFM_MARKER_qt_se] = {"qt", CSFM_MARKER_KIND_MILESTONE},
+    [CSFM_MARKER_ts_se] = {"ts", CSFM_MARKER_KIND_MILESTONE},
+    [CSFM_MARKER_ef] = {"ef", CSFM_MARKER_KIND_NOTE},
+    [CSFM_MARKER_ex] = {"ex", CSFM_MARKER_KIND_NOTE},
+    [CSFM_MARKER_esb] = {"esb", CSFM_MARKER_KIND_PARAGRAPH},
+    [CSFM_MARKER_esbe] = {"esbe", CSFM_MARKER_KIND_PARAGRAPH},
+    [CSFM_MARKER_cat] = {"cat", CSFM_MARKER_KIND_CHARACTER},
+    [CSFM_MARKER_periph] = {"periph", CSFM_MARKER_KIND_PARAGRAPH},
+    [CSFM_MARKER_UNKNOWN] = {"", CSFM_MARKER_KIND_UNKNOWN},
+};
+
+// NOTE(mattg): Sorted by name (byte order) for the binary search in
+// CSFM_Marker_fromName. The milestones are not in here, they are only
+// reachable through their `-s`/`-e` suffix.
+static const uint8_t CSFM_MARKER_BY_NAME[] = {
+    CSFM_MARKER_add, CSFM_MARKER_addpn, CSFM_MARKER_b, CSFM_MARKER_bd, CSFM_MARKER_bdit,
+    CSFM_MARKER_bk, CSFM_MARKER_c, CSFM_MARKER_ca, CSFM_MARKER_cat, CSFM_MARKER_cd,
+    CSFM_MARKER_cl, CSFM_MARKER_cls, CSFM_MARKER_cp, CSFM_MARKER_d, CSFM_MARKER_dc,
+    CSFM_MARKER_ef, CSFM_MARKER_em, CSFM_MARKER_esb, CSFM_MARKER_esbe, CSFM_MARKER_ex,
+    CSFM_MARKER_f, CSFM_MARKER_fdc, CSFM_MARKER_fe, CSFM_MARKER_fig, CSFM_MARKER_fk,
+    CSFM_MARKER_fl, CSFM_MARKER_fm, CSFM_MARKER_fp, CSFM_MARKER_fq, CSFM_MARKER_fqa,
+    CSFM_MARKER_fr, CSFM_MARKER_ft, CSFM_MARKER_fv, CSFM_MARKER_fw, CSFM_MARKER_h,
+    CSFM_MARKER_ib, CSFM_MARKER_id, CSFM_MARKER_ide, CSFM_MARKER_ie, CSFM_MARKER_iex,
+    CSFM_MARKER_ili, CSFM_MARKER_im, CSFM_MARKER_imi, CSFM_MARKER_imq, CSFM_MARKER_imt,
+    CSFM_MARKER_imte, CSFM_MARKER_io, CSFM_MARKER_ior, CSFM_MARKER_iot, CSFM_MARKER_ip,
+    CSFM_MARKER_ipi, CSFM_MARKER_ipq, CSFM_MARKER_iq, CSFM_MARKER_iqt, CSFM_MARKER_is,
+    CSFM_MARKER_it, CSFM_MARKER_jmp, CSFM_MARKER_k, CSFM_MARKER_lf, CSFM_MARKER_lh,
+    CSFM_MARKER_li, CSFM_MARKER_lik, CSFM_MARKER_lim, CSFM_MARKER_lit, CSFM_MARKER_litl,
+    CSFM_MARKER_liv, CSFM_MARKER_m, CSFM_MARKER_mi, CSFM_MARKER_mr, CSFM_MARKER_ms,
+    CSFM_MARKER_mt, CSFM_MARKER_mte, CSFM_MARKER_nb, CSFM_MARKER_nd, CSFM_MARKER_ndx,
+    CSFM_MARKER_no, CSFM_MARKER_ord, CSFM_MARKER_p, CSFM_MARKER_pb, CSFM_MARKER_pc,
+    CSFM_MARKER_periph, CSFM_MARKER_ph, CSFM_MARKER_pi, CSFM_MARKER_pm, CSFM_MARKER_pmc,
+    CSFM_MARKER_pmo, CSFM_MARKER_pmr, CSFM_MARKER_pn, CSFM_MARKER_png, CSFM_MARKER_po,
+    CSFM_MARKER_pr, CSFM_MARKER_pro, CSFM_MARKER_q, CSFM_MARKER_qa, CSFM_MARKER_qac,
+    CSFM_MARKER_qc, CSFM_MARKER_qd, CSFM_MARKER_qm, CSFM_MARKER_qr, CSFM_MARKER_qs,
+    CSFM_MARKER_qt, CSFM_MARKER_r, CSFM_MARKER_rb, CSFM_MARKER_rem, CSFM_MARKER_rq,
+    CSFM_MARKER_s, CSFM_MARKER_sc, CSFM_MARKER_sd, CSFM_MARKER_sig, CSFM_MARKER_sls,
+    CSFM_MARKER_sp, CSFM_MARKER_sr, CSFM_MARKER_sts, CSFM_MARKER_sup, CSFM_MARKER_tc,
+    CSFM_MARKER_tcr, CSFM_MARKER_th, CSFM_MARKER_thr, CSFM_MARKER_tl, CSFM_MARKER_toc,
+    CSFM_MARKER_toca, CSFM_MARKER_tr, CSFM_MARKER_usfm, CSFM_MARKER_v, CSFM_MARKER_va,
+    CSFM_MARKER_vp, CSFM_MARKER_w, CSFM_MARKER_wa, CSFM_MARKER_wg, CSFM_MARKER_wh,
+    CSFM_MARKER_wj, CSFM_MARKER_x, CSFM_MARKER_xdc, CSFM_MARKER_xk, CSFM_MARKER_xnt,
+    CSFM_MARKER_xo, CSFM_MARKER_xop, CSFM_MARKER_xot, CSFM_MARKER_xq, CSFM_MARKER_xt,
+    CSFM_MARKER_xta,
+};
+
+CSFM_Marker CSFM_Marker_fromName(const uint8_t *name, uint32_t length) {
+    uint32_t low = 0;
+    uint32_t high = sizeof(CSFM_MARKER_BY_NAME) / sizeof(CSFM_MARKER_BY_NAME[0]);
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        const char *candidate = CSFM_MARKER_INFO[CSFM_MARKER_BY_NAME[mid]].name;
+        uint32_t candidateLength = (uint32_t)strlen(candidate);
+        uint32_t common = length < candidateLength ? length : candidateLength;
+        int order = memcmp(name, candidate, common);
+        if (order == 0) {
+            order = (length > candidateLength) - (length < candidateLength);
+        }
+        if (order == 0) {
+            return (CSFM_Marker)CSFM_MARKER_BY_NAME[mid];
+        } else if (order < 0) {
+            high = mid;
+        } else {
+            low = mid + 1;
+        }
+    }
+    return CSFM_MARKER_UNKNOWN;
+}
+
+const char *CSFM_Marker_name(CSFM_Marker marker) {
+    if ((uint32_t)marker >= CSFM_MARKER_COUNT) {
+        marker = CSFM_MARKER_UNKNOWN;
+    }
+    return CSFM_MARKER_INFO[marker].name;
+}
+
+CSFM_MarkerKind CSFM_Marker_kind(CSFM_Marker marker) {
+    if ((uint32_t)marker >= CSFM_MARKER_COUNT) {
+        marker = CSFM_MARKER_UNKNOWN;
+    }
+    return CSFM_MARKER_INFO[marker].kind;
+}
+
+void CSFM_IndexArray_deallocate(CSFM_IndexArray *array) {
+    if (array == NULL) {
+        return;
+    }
+    if (array->buffer != NULL) {
+        free(array->buffer);
+        array->buffer = NULL;
+    }
+    array->length = 0;
+    array->capacity = 0;
+}
+
+static CSFM_ErrorType CSFM_IndexArray_push(CSFM_IndexArray *array, uint32_t value) {
+    if (array->length >= array->capacity) {
+        uint32_t newCapacity = array->capacity == 0 ? 16 : array->capacity * 2;
+        uint32_t *newBuffer = realloc(array->buffer, sizeof(uint32_t) * newCapacity);
+        if (newBuffer == NULL) {
+            return CSFM_ERROR_OUT_OF_MEMORY;
+        }
+        array->buffer = newBuffer;
+        array->capacity = newCapacity;
+    }
+    array->buffer[array->length] = value;
+    array->length++;
+    return CSFM_ERROR_SUCCESS;
+}
+
+#if defined(__GNUC__) || defined(__clang__)
+#define CSFM_COLD __attribute__((cold, noinline))
+#else
+#define CSFM_COLD
+#endif
+
+void CSFM_DiagnosticArray_deallocate(CSFM_DiagnosticArray *array) {
+    if (array == NULL) {
+        return;
+    }
+    if (array->buffer != NULL) {
+        free(array->buffer);
+        array->buffer = NULL;
+    }
+    array->length = 0;
+    array->capacity = 0;
+}
+
+CSFM_Diagnostic CSFM_DiagnosticArray_get(CSFM_DiagnosticArray array, uint32_t index) {
     if (index < array.length && array.buffer != NULL) {
         return array.buffer[index];
     }
-    CSFM_Node stub = {0};
+    CSFM_Diagnostic stub = {0};
     return stub;
 }
 
-void parseMarker(CSFM_String8Slice input, uint32_t *tokenIndex, CSFM_Token *token, CSFM_Node *node) {
-    CSFM_Token currToken = peekToken(input, *tokenIndex);
+const char *CSFM_DiagnosticCode_name(CSFM_DiagnosticCode code) {
+    switch (code) {
+    case CSFM_DIAGNOSTIC_MISSING_MARKER_NAME:
+        return "missing marker name";
+    case CSFM_DIAGNOSTIC_MISSING_NESTED_MARKER_NAME:
+        return "missing nested marker name";
+    case CSFM_DIAGNOSTIC_UNMATCHED_CLOSE_MARKER:
+        return "unmatched close marker";
+    case CSFM_DIAGNOSTIC_MALFORMED_ATTRIBUTE:
+        return "malformed attribute";
+    }
+    return "unknown diagnostic";
+}
+
+#ifndef CSFM_NO_DIAGNOSTICS
+static CSFM_COLD void CSFM_DiagnosticArray_report(
+    CSFM_DiagnosticArray *array, CSFM_DiagnosticCode code, uint32_t offset, uint32_t nodeIndex
+) {
+    if (array == NULL) {
+        return;
+    }
+    if (array->length >= array->capacity) {
+        uint32_t newCapacity = array->capacity == 0 ? 16 : array->capacity * 2;
+        CSFM_Diagnostic *newBuffer = realloc(array->buffer, sizeof(CSFM_Diagnostic) * newCapacity);
+        if (newBuffer == NULL) {
+            // NOTE(mattg): Losing a diagnostic is better than losing the parse.
+            return;
+        }
+        array->buffer = newBuffer;
+        array->capacity = newCapacity;
+    }
+    CSFM_Diagnostic diagnostic = {
+        .code = code,
+        .offset = offset,
+        .node_index = nodeIndex,
+    };
+    array->buffer[array->length] = diagnostic;
+    array->length++;
+}
+#define CSFM_REPORT(array, code, offset, nodeIndex) \
+    CSFM_DiagnosticArray_report((array), (code), (offset), (nodeIndex))
+#else
+#define CSFM_REPORT(array, code, offset, nodeIndex) \
+    ((void)(array), (void)(offset), (void)(nodeIndex))
+#endif
+
+// Where the parser gets its tokens from: scanned straight out of `input`,
+// or looked up in `tokens` a tokenizer stage already produced for the same
+// bytes (see CSFM_Pipeline_parse).
+typedef struct {
+    CSFM_String8Slice input;
+    const CSFM_Token *tokens;
+    uint32_t count;
+    uint32_t position;
+} CSFM_TokenSource;
+
+// NOTE(mattg): The parser only ever asks for the token right after the one
+// it has, or goes back to the start of the current one, so this is a step
+// or two from `position`. Anything outside of `tokens` is scanned.
+static CSFM_Token CSFM_TokenSource_lookup(CSFM_TokenSource *source, uint32_t index) {
+    uint32_t position = source->position;
+    while (position > 0 && position < source->count && source->tokens[position].start > index) {
+        position--;
+    }
+    while (position < source->count && source->tokens[position].end <= index) {
+        position++;
+    }
+    if (position < source->count && source->tokens[position].start == index) {
+        source->position = position;
+        return source->tokens[position];
+    }
+    return peekToken(source->input, index);
+}
+
+static inline CSFM_Token CSFM_TokenSource_peek(CSFM_TokenSource *source, uint32_t index) {
+    if (source->tokens == NULL) {
+        return peekToken(source->input, index);
+    }
+    return CSFM_TokenSource_lookup(source, index);
+}
+
+static inline CSFM_Token CSFM_TokenSource_consume(CSFM_TokenSource *source, uint32_t *index) {
+    CSFM_Token token = CSFM_TokenSource_peek(source, *index);
+    *index = token.end;
+    return token;
+}
+
+void parseMarker(
+    CSFM_TokenSource *source, uint32_t *tokenIndex, CSFM_Token *token, CSFM_Node *node,
+    CSFM_DiagnosticArray *diagnostics, uint32_t nodeIndex
+) {
+    CSFM_String8Slice input = source->input;
+    CSFM_Token currToken = CSFM_TokenSource_peek(source, *tokenIndex);
 
     // accept '+' OR '*' OR text.
     switch (currToken.type) {
@@ -730,39 +2487,69 @@ void parseMarker(CSFM_String8Slice input, uint32_t *tokenIndex, CSFM_Token *toke
         node->marker_type = CSFM_MARKER_TYPE_NESTED;
         node->end = currToken.end;
         *tokenIndex = currToken.end;
-        currToken = peekToken(input, *tokenIndex);
+        currToken = CSFM_TokenSource_peek(source, *tokenIndex);
         
         // just get the text after the plus
-        node->end = currToken.end;
         if (currToken.type != CSFM_TOKEN_TEXT) {
-            // TODO(mattg): error handling. Something something unexpected token.
+            CSFM_REPORT(diagnostics, CSFM_DIAGNOSTIC_MISSING_NESTED_MARKER_NAME, currToken.start, nodeIndex);
             return;
         }
+        node->end = currToken.end;
         node->marker_text_start = currToken.start;
         node->marker_text_end = currToken.end;
+        node->marker = CSFM_Marker_fromName(&input.ptr[currToken.start], currToken.end - currToken.start);
         *tokenIndex = currToken.end;
         *token = currToken;
-        currToken = peekToken(input, *tokenIndex);
+        currToken = CSFM_TokenSource_peek(source, *tokenIndex);
         break;
     case CSFM_TOKEN_TEXT:
         node->end = currToken.end;
         node->marker_text_start = currToken.start;
         node->marker_text_end = currToken.end;
+        node->marker = CSFM_Marker_fromName(&input.ptr[currToken.start], currToken.end - currToken.start);
         *tokenIndex = currToken.end;
         *token = currToken;
-        currToken = peekToken(input, *tokenIndex);
+        currToken = CSFM_TokenSource_peek(source, *tokenIndex);
         break;
     default:
         node->end = currToken.start;
-        // TODO(mattg): error handling. Something something unexpected token.
+        CSFM_REPORT(diagnostics, CSFM_DIAGNOSTIC_MISSING_MARKER_NAME, currToken.start, nodeIndex);
         return;
     }
     
     // accept number
-    // NOTE(mattg): this would change the marker text length, but for now we don't track that.
+    // NOTE(mattg): The number is part of the node but not of the marker text,
+    // so `\s1` and `\s2` both look up as `s`.
+    if (currToken.type == CSFM_TOKEN_NUMBER) {
+        node->end = currToken.end;
+        *tokenIndex = currToken.end;
+        *token = currToken;
+        currToken = CSFM_TokenSource_peek(source, *tokenIndex);
+    }
 
     // accept -
-    // if - expect text or number
+    // if - expect `s` or `e` (milestone start/end), otherwise leave it as text
+    if (currToken.type == CSFM_TOKEN_MINUS) {
+        CSFM_Token suffix = CSFM_TokenSource_peek(source, currToken.end);
+        // NOTE(mattg): At the end of the input the suffix is the NULL token,
+        // only look at its byte once it is known to be one letter of text.
+        if (suffix.type == CSFM_TOKEN_TEXT && suffix.end - suffix.start == 1 &&
+            (input.ptr[suffix.start] == 's' || input.ptr[suffix.start] == 'e')) {
+            uint32_t nameLength = node->marker_text_end - node->marker_text_start;
+            if (node->marker == CSFM_MARKER_qt) {
+                node->marker = CSFM_MARKER_qt_se;
+            } else if (nameLength == 2 && memcmp(&input.ptr[node->marker_text_start], "ts", 2) == 0) {
+                node->marker = CSFM_MARKER_ts_se;
+            } else {
+                node->marker = CSFM_MARKER_UNKNOWN;
+            }
+            node->end = suffix.end;
+            *tokenIndex = suffix.end;
+            *token = suffix;
+            currToken = CSFM_TokenSource_peek(source, *tokenIndex);
+        }
+    }
+
     // accept *
     if (currToken.type == CSFM_TOKEN_ASTERISK) {
         node->marker_type++;
@@ -780,11 +2567,12 @@ void parseMarker(CSFM_String8Slice input, uint32_t *tokenIndex, CSFM_Token *toke
 
 }
 
-void parseText(CSFM_String8Slice input, uint32_t *tokenIndex, CSFM_Token *token, CSFM_Node *node) {
+void parseText(CSFM_TokenSource *source, uint32_t *tokenIndex, CSFM_Token *token, CSFM_Node *node, bool stopAtPipe) {
+    CSFM_String8Slice input = source->input;
     CSFM_Token currToken = {0};
     bool endParse = false;
     while (!endParse && *tokenIndex < input.length) {
-        currToken = peekToken(input, *tokenIndex);
+        currToken = CSFM_TokenSource_peek(source, *tokenIndex);
         switch (token->type) {
         case CSFM_TOKEN_NULL:
         case CSFM_TOKEN_CR:
@@ -792,6 +2580,15 @@ void parseText(CSFM_String8Slice input, uint32_t *tokenIndex, CSFM_Token *token,
         case CSFM_TOKEN_BACKSLASH:
             endParse = true;
             break;
+        case CSFM_TOKEN_PIPE:
+            if (stopAtPipe && token->start != node->start) {
+                endParse = true;
+                break;
+            }
+            node->end = token->end;
+            *tokenIndex = token->end;
+            *token = currToken;
+            break;
         default:
             node->end = token->end;
             *tokenIndex = token->end;
@@ -801,70 +2598,3231 @@ void parseText(CSFM_String8Slice input, uint32_t *tokenIndex, CSFM_Token *token,
 }
 
 CSFM_ParseResult CSFM_Parse(uint8_t *buf, uint32_t size) {
-    CSFM_ParseResult result = {
-        .input = {
-            .ptr = buf,
-            .length = size,
-        },
-    };
-    if (CSFM_NodeArray_allocate(&result.tree, size) != 0) {
-        return result;
+    CSFM_Options options = {0};
+    return CSFM_ParseWithOptions(buf, size, options);
+}
+
+void CSFM_AttributeArray_deallocate(CSFM_AttributeArray *array) {
+    if (array == NULL) {
+        return;
+    }
+    if (array->buffer != NULL) {
+        free(array->buffer);
+        array->buffer = NULL;
     }
+    array->length = 0;
+    array->capacity = 0;
+}
 
-    uint32_t tokenIndex = 0;
-    CSFM_Token token = {0};
-    CSFM_Token prevToken = {0};
-    CSFM_Node prevNode = {0};
-    do {
-        token = consumeToken(result.input, &tokenIndex);
+CSFM_Attribute CSFM_AttributeArray_get(CSFM_AttributeArray array, uint32_t index) {
+    if (index < array.length && array.buffer != NULL) {
+        return array.buffer[index];
+    }
+    CSFM_Attribute stub = {0};
+    return stub;
+}
 
-        CSFM_Node node = {
-            .start = token.start,
-            .end = token.end,
-        };
+static CSFM_ErrorType CSFM_AttributeArray_push(CSFM_AttributeArray *array, CSFM_Attribute attribute) {
+    if (array->length >= array->capacity) {
+        uint32_t newCapacity = array->capacity == 0 ? 64 : array->capacity * 2;
+        CSFM_Attribute *newBuffer = realloc(array->buffer, sizeof(CSFM_Attribute) * newCapacity);
+        if (newBuffer == NULL) {
+            return CSFM_ERROR_OUT_OF_MEMORY;
+        }
+        array->buffer = newBuffer;
+        array->capacity = newCapacity;
+    }
+    array->buffer[array->length] = attribute;
+    array->length++;
+    return CSFM_ERROR_SUCCESS;
+}
 
-        switch (token.type) {
-        case CSFM_TOKEN_NULL:
-            node.type = CSFM_NODE_NULL;
-            break;
-        case CSFM_TOKEN_BACKSLASH:
-            node.type = CSFM_NODE_MARKER;
-            assert(node.marker_type == CSFM_MARKER_TYPE_NORMAL);
-            parseMarker(result.input, &tokenIndex, &token, &node);
-            break;
-        case CSFM_TOKEN_WS:
-            node.type = CSFM_NODE_WHITESPACE;
-            break;
-        case CSFM_TOKEN_CR:
-            node.type = CSFM_NODE_NEWLINE;
+const char *CSFM_Marker_defaultAttribute(CSFM_Marker marker) {
+    switch (marker) {
+    case CSFM_MARKER_w:
+        return "lemma";
+    case CSFM_MARKER_rb:
+        return "gloss";
+    case CSFM_MARKER_xt:
+    case CSFM_MARKER_jmp:
+        return "link-href";
+    case CSFM_MARKER_fig:
+        return "src";
+    case CSFM_MARKER_qt_se:
+        return "who";
+    default:
+        return NULL;
+    }
+}
+
+static inline bool CSFM_isAttributeSpace(uint8_t c) {
+    return c == ' ' || c == '\t';
+}
+
+static bool CSFM_Node_isMilestone(CSFM_String8Slice input, const CSFM_Node *node) {
+    if (node->marker_type != CSFM_MARKER_TYPE_NORMAL || node->end < node->marker_text_end + 2) {
+        return false;
+    }
+    uint8_t suffix = input.ptr[node->end - 1];
+    return input.ptr[node->end - 2] == '-' && (suffix == 's' || suffix == 'e');
+}
+
+// The marker an attribute list right now would belong to: the milestone
+// just parsed, otherwise the innermost open character marker if it is one
+// that takes attributes (\w, \rb, \fig, \jmp).
+static uint32_t CSFM_attributeOwner(CSFM_ParseResult *result, CSFM_IndexArray *stack, uint32_t lastMarker) {
+    if (lastMarker < result->tree.length && CSFM_Node_isMilestone(result->input, CSFM_NodeArray_at(&result->tree, lastMarker))) {
+        return lastMarker;
+    }
+    if (stack->length > 0) {
+        uint32_t top = stack->buffer[stack->length - 1];
+        CSFM_Marker marker = CSFM_NodeArray_at(&result->tree, top)->marker;
+        // NOTE(mattg): Inside a footnote the top is a note character marker
+        // (\ft, \fq, \xt, ...), a `|` there is just text, same as in \wj or
+        // \add.
+        if (CSFM_Marker_kind(marker) == CSFM_MARKER_KIND_CHARACTER && CSFM_Marker_defaultAttribute(marker) != NULL) {
+            return top;
+        }
+    }
+    return UINT32_MAX;
+}
+
+// Parses the attribute list that starts at the `|` at `*index`, up to the
+// next marker or line break. Fills `node` as the ATTRIBUTES node and points
+// the owner at the new attributes.
+static void parseAttributes(
+    CSFM_ParseResult *result, uint32_t *index, CSFM_Node *node, uint32_t nodeIndex, uint32_t owner
+) {
+    CSFM_String8Slice input = result->input;
+    uint32_t start = *index;
+    uint32_t stop = start + 1;
+    while (stop < input.length && input.ptr[stop] != '\\' && input.ptr[stop] != '\r' && input.ptr[stop] != '\n') {
+        stop++;
+    }
+    node->type = CSFM_NODE_ATTRIBUTES;
+    node->start = start;
+    node->end = stop;
+    node->attribute_index = result->attributes.length;
+    *index = stop;
+
+    bool named = memchr(&input.ptr[start + 1], '=', stop - start - 1) != NULL;
+    uint32_t i = start + 1;
+    while (i < stop) {
+        while (i < stop && CSFM_isAttributeSpace(input.ptr[i])) {
+            i++;
+        }
+        if (i >= stop) {
             break;
-        case CSFM_TOKEN_LF:
-            node.type = CSFM_NODE_NEWLINE;
-            if (prevToken.type == CSFM_TOKEN_CR) {
-                node.start = prevNode.start;
-                // NOTE(mattg): Remove the last element (it was a CR), replace it with 1 newline node.
-                CSFM_NodeArray_pop(&result.tree);
+        }
+        CSFM_Attribute attribute = {
+            .node = owner,
+        };
+
+        if (!named) {
+            // default attribute, the whole (trimmed, unquoted) list is the value
+            uint32_t end = stop;
+            while (end > i && CSFM_isAttributeSpace(input.ptr[end - 1])) {
+                end--;
             }
-            break;
-        default:
-            node.type = CSFM_NODE_TEXT;
-            parseText(result.input, &tokenIndex, &token, &node);
-            break;
+            if (end - i >= 2 && input.ptr[i] == '"' && input.ptr[end - 1] == '"') {
+                i++;
+                end--;
+            }
+            attribute.key_start = attribute.key_end = i;
+            attribute.value_start = i;
+            attribute.value_end = end;
+            i = stop;
+        } else {
+            attribute.key_start = i;
+            while (i < stop && input.ptr[i] != '=' && !CSFM_isAttributeSpace(input.ptr[i])) {
+                i++;
+            }
+            attribute.key_end = i;
+            while (i < stop && CSFM_isAttributeSpace(input.ptr[i])) {
+                i++;
+            }
+            if (attribute.key_end == attribute.key_start || i >= stop || input.ptr[i] != '=') {
+                CSFM_REPORT(&result->diagnostics, CSFM_DIAGNOSTIC_MALFORMED_ATTRIBUTE, i, nodeIndex);
+                break;
+            }
+            i++;
+            while (i < stop && CSFM_isAttributeSpace(input.ptr[i])) {
+                i++;
+            }
+            if (i >= stop || input.ptr[i] != '"') {
+                CSFM_REPORT(&result->diagnostics, CSFM_DIAGNOSTIC_MALFORMED_ATTRIBUTE, i, nodeIndex);
+                break;
+            }
+            i++;
+            attribute.value_start = i;
+            const uint8_t *quote = memchr(&input.ptr[i], '"', stop - i);
+            if (quote == NULL) {
+                CSFM_REPORT(&result->diagnostics, CSFM_DIAGNOSTIC_MALFORMED_ATTRIBUTE, i, nodeIndex);
+                break;
+            }
+            attribute.value_end = (uint32_t)(quote - input.ptr);
+            i = attribute.value_end + 1;
         }
 
-        if (CSFM_NodeArray_push(&result.tree, node) != 0) {
-            return result;
+        if (CSFM_AttributeArray_push(&result->attributes, attribute) != CSFM_ERROR_SUCCESS) {
+            result->error = CSFM_ERROR_OUT_OF_MEMORY;
+            break;
         }
-        prevToken = token;
-        prevNode = node;
-    } while (
-        token.type != CSFM_TOKEN_NULL &&
-        tokenIndex < result.input.length &&
-        result.tree.length < CSFM_NODE_ARRAY_CAPACITY_MAX
-    );
+    }
 
+    node->attribute_count = result->attributes.length - node->attribute_index;
+    CSFM_Node *ownerNode = CSFM_NodeArray_at(&result->tree, owner);
+    // NOTE(mattg): A second list for the same marker is unusual, keep both by
+    // extending the range when they are adjacent.
+    if (ownerNode->attribute_count > 0 && ownerNode->attribute_index + ownerNode->attribute_count == node->attribute_index) {
+        ownerNode->attribute_count += node->attribute_count;
+    } else {
+        ownerNode->attribute_index = node->attribute_index;
+        ownerNode->attribute_count = node->attribute_count;
+    }
+}
 
-    return result;
+static bool CSFM_sameMarker(CSFM_String8Slice input, CSFM_Node *a, CSFM_Node *b) {
+    if (a->marker != b->marker) {
+        return false;
+    }
+    if (a->marker != CSFM_MARKER_UNKNOWN) {
+        return true;
+    }
+    uint32_t length = a->marker_text_end - a->marker_text_start;
+    return length == b->marker_text_end - b->marker_text_start &&
+        memcmp(&input.ptr[a->marker_text_start], &input.ptr[b->marker_text_start], length) == 0;
+}
+
+// Keeps `stack` holding the markers that are still open after `node`.
+// Paragraph level markers implicitly close everything, a note character
+// marker closes whatever is open inside its note.
+static void CSFM_trackMarker(CSFM_ParseResult *result, CSFM_IndexArray *stack, CSFM_Node *node, uint32_t nodeIndex) {
+    if (node->marker_text_end == node->marker_text_start) {
+        // NOTE(mattg): `\*` and broken markers, nothing to match.
+        return;
+    }
+
+    if (node->marker_type == CSFM_MARKER_TYPE_CLOSE || node->marker_type == CSFM_MARKER_TYPE_NESTED_CLOSE) {
+        uint32_t depth = stack->length;
+        while (depth > 0) {
+            CSFM_Node *open = CSFM_NodeArray_at(&result->tree, stack->buffer[depth - 1]);
+            if (CSFM_sameMarker(result->input, open, node)) {
+                stack->length = depth - 1;
+                return;
+            }
+            depth--;
+        }
+        CSFM_REPORT(&result->diagnostics, CSFM_DIAGNOSTIC_UNMATCHED_CLOSE_MARKER, node->start, nodeIndex);
+        return;
+    }
+
+    switch (CSFM_Marker_kind(node->marker)) {
+    case CSFM_MARKER_KIND_HEADER:
+    case CSFM_MARKER_KIND_PARAGRAPH:
+    case CSFM_MARKER_KIND_CHAPTER:
+        stack->length = 0;
+        return;
+    case CSFM_MARKER_KIND_VERSE:
+    case CSFM_MARKER_KIND_MILESTONE:
+        return;
+    case CSFM_MARKER_KIND_NOTE_CHARACTER:
+        if (node->marker_type == CSFM_MARKER_TYPE_NORMAL) {
+            while (stack->length > 0) {
+                CSFM_Node *open = CSFM_NodeArray_at(&result->tree, stack->buffer[stack->length - 1]);
+                if (CSFM_Marker_kind(open->marker) == CSFM_MARKER_KIND_NOTE) {
+                    break;
+                }
+                stack->length--;
+            }
+        }
+        break;
+    default:
+        break;
+    }
+    // NOTE(mattg): If this fails the marker just never gets matched, the
+    // tree itself is unaffected.
+    CSFM_IndexArray_push(stack, nodeIndex);
+}
+
+static CSFM_ErrorType CSFM_PostingLists_begin(CSFM_PostingLists *postings) {
+    postings->nodes.length = 0;
+    postings->offsets.length = 0;
+    for (uint32_t i = 0; i < CSFM_MARKER_COUNT + 1; i++) {
+        if (CSFM_IndexArray_push(&postings->offsets, 0) != CSFM_ERROR_SUCCESS) {
+            return CSFM_ERROR_OUT_OF_MEMORY;
+        }
+    }
+    return CSFM_ERROR_SUCCESS;
+}
+
+// Buckets `markerNodes` (document order) by marker. `offsets` already holds
+// the per-marker counts shifted up by one.
+static CSFM_ErrorType CSFM_PostingLists_finish(
+    CSFM_PostingLists *postings, const CSFM_NodeArray *tree, const CSFM_IndexArray *markerNodes
+) {
+    uint32_t *offsets = postings->offsets.buffer;
+    for (uint32_t i = 1; i < CSFM_MARKER_COUNT + 1; i++) {
+        offsets[i] += offsets[i - 1];
+    }
+    if (postings->nodes.capacity < markerNodes->length) {
+        uint32_t *newBuffer = realloc(postings->nodes.buffer, sizeof(uint32_t) * markerNodes->length);
+        if (newBuffer == NULL) {
+            return CSFM_ERROR_OUT_OF_MEMORY;
+        }
+        postings->nodes.buffer = newBuffer;
+        postings->nodes.capacity = markerNodes->length;
+    }
+    postings->nodes.length = markerNodes->length;
+
+    // NOTE(mattg): offsets[m] walks forward while filling and ends up at the
+    // start of marker m + 1, the shift below puts every bucket back.
+    for (uint32_t i = 0; i < markerNodes->length; i++) {
+        uint32_t nodeIndex = markerNodes->buffer[i];
+        CSFM_Marker marker = CSFM_NodeArray_at(tree, nodeIndex)->marker;
+        postings->nodes.buffer[offsets[marker]] = nodeIndex;
+        offsets[marker]++;
+    }
+    for (uint32_t i = CSFM_MARKER_COUNT; i > 0; i--) {
+        offsets[i] = offsets[i - 1];
+    }
+    offsets[0] = 0;
+    return CSFM_ERROR_SUCCESS;
+}
+
+// Everything the parse loop carries from one call of CSFM_ParseState_run to
+// the next, so input that arrives in pieces can be parsed as it comes.
+typedef struct {
+    CSFM_Context *context;
+    bool validate;
+    uint32_t validated;
+    bool postings;
+    bool attributes;
+    uint32_t lastMarker;
+    uint32_t tokenIndex;
+    CSFM_Token prevToken;
+    CSFM_Node prevNode;
+} CSFM_ParseState;
+
+static void CSFM_ParseState_begin(
+    CSFM_ParseState *state, CSFM_ParseResult *result, CSFM_Options options, CSFM_Context *context
+) {
+    memset(state, 0, sizeof(CSFM_ParseState));
+    state->context = context;
+    state->validate = (options.flags & CSFM_OPTION_VALIDATE_UTF8) != 0;
+    context->marker_stack.length = 0;
+
+    state->postings = (options.flags & CSFM_OPTION_POSTING_LISTS) != 0;
+    context->marker_nodes.length = 0;
+    if (state->postings && CSFM_PostingLists_begin(&result->postings) != CSFM_ERROR_SUCCESS) {
+        result->error = CSFM_ERROR_OUT_OF_MEMORY;
+        state->postings = false;
+    }
+
+    state->attributes = (options.flags & CSFM_OPTION_ATTRIBUTES) != 0;
+    state->lastMarker = UINT32_MAX;
+    result->attributes.length = 0;
+}
+
+// Parses nodes until `limit` is reached. Stopping short of the end is only
+// safe right after a line break, nothing the parser looks ahead at crosses
+// one.
+static void CSFM_ParseState_run(
+    CSFM_ParseState *state, CSFM_ParseResult *result, CSFM_TokenSource *source, uint32_t limit
+) {
+    CSFM_IndexArray *markerStack = &state->context->marker_stack;
+    CSFM_IndexArray *markerNodes = &state->context->marker_nodes;
+    uint32_t tokenIndex = state->tokenIndex;
+    CSFM_Token token = {0};
+    CSFM_Token prevToken = state->prevToken;
+    CSFM_Node prevNode = state->prevNode;
+    // NOTE(mattg): Kept in locals, the compiler can't tell the stores to the
+    // tree don't touch `state`.
+    bool validate = state->validate;
+    uint32_t validated = state->validated;
+    bool postings = state->postings;
+    bool attributes = state->attributes;
+    uint32_t lastMarker = state->lastMarker;
+    uint32_t deepest = state->context->peak_depth;
+    do {
+        token = CSFM_TokenSource_consume(source, &tokenIndex);
+
+        CSFM_Node node = {
+            .start = token.start,
+            .end = token.end,
+            .marker = CSFM_MARKER_UNKNOWN,
+        };
+
+        // NOTE(mattg): Only a `|` or text can involve attributes, the owner
+        // lookup is left to those cases.
+        uint32_t owner = UINT32_MAX;
+        switch (token.type) {
+        case CSFM_TOKEN_NULL:
+            node.type = CSFM_NODE_NULL;
+            break;
+        case CSFM_TOKEN_BACKSLASH:
+            node.type = CSFM_NODE_MARKER;
+            assert(node.marker_type == CSFM_MARKER_TYPE_NORMAL);
+            parseMarker(source, &tokenIndex, &token, &node, &result->diagnostics, result->tree.length);
+            break;
+        case CSFM_TOKEN_WS:
+            node.type = CSFM_NODE_WHITESPACE;
+            break;
+        case CSFM_TOKEN_CR:
+            node.type = CSFM_NODE_NEWLINE;
+            break;
+        case CSFM_TOKEN_LF:
+            node.type = CSFM_NODE_NEWLINE;
+            if (prevToken.type == CSFM_TOKEN_CR) {
+                node.start = prevNode.start;
+                // NOTE(mattg): Remove the last element (it was a CR), replace it with 1 newline node.
+                CSFM_NodeArray_pop(&result->tree);
+            }
+            break;
+        case CSFM_TOKEN_PIPE:
+            if (attributes) {
+                owner = CSFM_attributeOwner(result, markerStack, lastMarker);
+            }
+            if (owner != UINT32_MAX) {
+                tokenIndex = token.start;
+                parseAttributes(result, &tokenIndex, &node, result->tree.length, owner);
+                token = CSFM_TokenSource_peek(source, tokenIndex);
+                break;
+            }
+            // fallthrough
+        default:
+            node.type = CSFM_NODE_TEXT;
+            if (attributes && token.type != CSFM_TOKEN_PIPE) {
+                owner = CSFM_attributeOwner(result, markerStack, lastMarker);
+            }
+            parseText(source, &tokenIndex, &token, &node, owner != UINT32_MAX);
+            break;
+        }
+
+        if (validate && !CSFM_UTF8_validateBehind(result->input, &validated, tokenIndex, false, &result->error_offset)) {
+            result->error = CSFM_ERROR_INVALID_UTF8;
+            validate = false;
+        }
+
+        uint32_t nodeIndex = result->tree.length;
+        if (CSFM_NodeArray_push(&result->tree, node) != CSFM_ERROR_SUCCESS) {
+            result->error = CSFM_ERROR_OUT_OF_MEMORY;
+            break;
+        }
+        if (node.type == CSFM_NODE_MARKER) {
+            lastMarker = nodeIndex;
+            CSFM_trackMarker(result, markerStack, CSFM_NodeArray_at(&result->tree, nodeIndex), nodeIndex);
+            if (markerStack->length > deepest) {
+                deepest = markerStack->length;
+            }
+            if (postings && (node.marker_type == CSFM_MARKER_TYPE_NORMAL || node.marker_type == CSFM_MARKER_TYPE_NESTED)) {
+                if (CSFM_IndexArray_push(markerNodes, nodeIndex) != CSFM_ERROR_SUCCESS) {
+                    result->error = CSFM_ERROR_OUT_OF_MEMORY;
+                    postings = false;
+                } else {
+                    result->postings.offsets.buffer[node.marker + 1]++;
+                }
+            }
+        }
+        prevToken = token;
+        prevNode = node;
+    } while (
+        token.type != CSFM_TOKEN_NULL &&
+        tokenIndex < limit &&
+        result->tree.length < CSFM_NODE_ARRAY_CAPACITY_MAX
+    );
+    state->context->peak_depth = deepest;
+    state->tokenIndex = tokenIndex;
+    state->prevToken = prevToken;
+    state->prevNode = prevNode;
+    state->validate = validate;
+    state->validated = validated;
+    state->postings = postings;
+    state->lastMarker = lastMarker;
+}
+
+static void CSFM_ParseState_finish(CSFM_ParseState *state, CSFM_ParseResult *result) {
+    if (state->validate && !CSFM_UTF8_validateBehind(result->input, &state->validated, state->tokenIndex, true, &result->error_offset)) {
+        result->error = CSFM_ERROR_INVALID_UTF8;
+    }
+    if (state->postings && CSFM_PostingLists_finish(&result->postings, &result->tree, &state->context->marker_nodes) != CSFM_ERROR_SUCCESS) {
+        result->error = CSFM_ERROR_OUT_OF_MEMORY;
+    }
+    state->context->marker_stack.length = 0;
+}
+
+// Parses `result->input` into `result->tree`, which must already have some
+// capacity. Scratch space comes from `context`.
+static void CSFM_parseInto(CSFM_ParseResult *result, CSFM_Options options, CSFM_Context *context) {
+    CSFM_ParseState state;
+    CSFM_ParseState_begin(&state, result, options, context);
+    if (result->error != CSFM_ERROR_SUCCESS) {
+        return;
+    }
+    CSFM_TokenSource source = {
+        .input = result->input,
+    };
+    CSFM_TRACE_BEGIN(build_tree);
+    CSFM_ParseState_run(&state, result, &source, result->input.length);
+    CSFM_ParseState_finish(&state, result);
+    CSFM_TRACE_END(build_tree, NULL, result->input.length);
+}
+
+CSFM_ParseResult CSFM_ParseWithOptions(uint8_t *buf, uint32_t size, CSFM_Options options) {
+    CSFM_ParseResult result = {
+        .input = {
+            .ptr = buf,
+            .length = size,
+        },
+    };
+    CSFM_Context context;
+    CSFM_Context_init(&context);
+    result.error = CSFM_NodeArray_allocate(&context.tree, size);
+    if (result.error != CSFM_ERROR_SUCCESS) {
+        return result;
+    }
+
+    result = CSFM_Context_parse(&context, buf, size, options);
+    // NOTE(mattg): The caller owns whatever ends up in the result, the rest
+    // of the context was scratch.
+    memset(&context.tree, 0, sizeof(context.tree));
+    memset(&context.diagnostics, 0, sizeof(context.diagnostics));
+    memset(&context.postings, 0, sizeof(context.postings));
+    memset(&context.attributes, 0, sizeof(context.attributes));
+    CSFM_Context_deallocate(&context);
+    return result;
+}
+
+void CSFM_ParseResult_deallocate(CSFM_ParseResult *result) {
+    if (result == NULL) {
+        return;
+    }
+    CSFM_NodeArray_deallocate(&result->tree);
+    CSFM_DiagnosticArray_deallocate(&result->diagnostics);
+    CSFM_PostingLists_deallocate(&result->postings);
+    CSFM_AttributeArray_deallocate(&result->attributes);
+}
+
+#define CSFM_CONTEXT_SHRINK_INTERVAL 64
+#define CSFM_CONTEXT_SHRINK_FACTOR 4
+// NOTE(mattg): Never shrink below this, small documents would otherwise pay
+// for a regrow right after every shrink.
+#define CSFM_CONTEXT_MIN_CAPACITY 1024
+
+void CSFM_Context_init(CSFM_Context *context) {
+    if (context == NULL) {
+        return;
+    }
+    memset(context, 0, sizeof(*context));
+    context->shrink_interval = CSFM_CONTEXT_SHRINK_INTERVAL;
+    context->shrink_factor = CSFM_CONTEXT_SHRINK_FACTOR;
+}
+
+void CSFM_Context_deallocate(CSFM_Context *context) {
+    if (context == NULL) {
+        return;
+    }
+    CSFM_TokenArray_deallocate(&context->tokens);
+    CSFM_NodeArray_deallocate(&context->tree);
+    CSFM_DiagnosticArray_deallocate(&context->diagnostics);
+    CSFM_PostingLists_deallocate(&context->postings);
+    CSFM_AttributeArray_deallocate(&context->attributes);
+    CSFM_IndexArray_deallocate(&context->marker_stack);
+    CSFM_IndexArray_deallocate(&context->marker_nodes);
+}
+
+static uint32_t CSFM_Context_shrinkTarget(CSFM_Context *context, uint32_t capacity, uint32_t peak) {
+    uint64_t limit = (uint64_t)peak * context->shrink_factor;
+    if (capacity <= CSFM_CONTEXT_MIN_CAPACITY || capacity <= limit) {
+        return capacity;
+    }
+    uint64_t target = (uint64_t)peak * 2;
+    return target > CSFM_CONTEXT_MIN_CAPACITY ? (uint32_t)target : CSFM_CONTEXT_MIN_CAPACITY;
+}
+
+static inline void CSFM_Context_track(uint32_t *peak, uint32_t length) {
+    if (length > *peak) {
+        *peak = length;
+    }
+}
+
+static void CSFM_Context_shrinkIndices(CSFM_Context *context, CSFM_IndexArray *array, uint32_t peak) {
+    array->length = 0;
+    CSFM_shrink((void **)&array->buffer, &array->capacity, CSFM_Context_shrinkTarget(context, array->capacity, peak), sizeof(uint32_t));
+}
+
+// Tracks the high-water marks and applies the shrink policy at the end of
+// every window. Called before the buffers are handed out again.
+static void CSFM_Context_endCall(CSFM_Context *context) {
+    CSFM_Context_track(&context->peak_tokens, context->tokens.length);
+    CSFM_Context_track(&context->peak_nodes, context->tree.length);
+    CSFM_Context_track(&context->peak_diagnostics, context->diagnostics.length);
+    CSFM_Context_track(&context->peak_attributes, context->attributes.length);
+    CSFM_Context_track(&context->peak_markers, context->marker_nodes.length);
+    context->calls++;
+    if (context->shrink_interval == 0 || context->calls < context->shrink_interval) {
+        return;
+    }
+
+    // NOTE(mattg): The last result is given up at this point, and clearing
+    // the lengths keeps a buffer a later parse never touches (attributes
+    // without CSFM_OPTION_ATTRIBUTES) from counting towards the next window.
+    CSFM_TokenArray_reuse(&context->tokens);
+    CSFM_NodeArray_reuse(&context->tree);
+    CSFM_TokenArray_shrink(&context->tokens, CSFM_Context_shrinkTarget(context, context->tokens.capacity, context->peak_tokens));
+    CSFM_NodeArray_shrink(&context->tree, CSFM_Context_shrinkTarget(context, context->tree.capacity, context->peak_nodes));
+    context->diagnostics.length = 0;
+    CSFM_shrink(
+        (void **)&context->diagnostics.buffer, &context->diagnostics.capacity,
+        CSFM_Context_shrinkTarget(context, context->diagnostics.capacity, context->peak_diagnostics), sizeof(CSFM_Diagnostic)
+    );
+    context->attributes.length = 0;
+    CSFM_shrink(
+        (void **)&context->attributes.buffer, &context->attributes.capacity,
+        CSFM_Context_shrinkTarget(context, context->attributes.capacity, context->peak_attributes), sizeof(CSFM_Attribute)
+    );
+    CSFM_Context_shrinkIndices(context, &context->marker_nodes, context->peak_markers);
+    CSFM_Context_shrinkIndices(context, &context->postings.nodes, context->peak_markers);
+    CSFM_Context_shrinkIndices(context, &context->marker_stack, context->peak_depth);
+    context->calls = 0;
+    context->peak_tokens = 0;
+    context->peak_nodes = 0;
+    context->peak_diagnostics = 0;
+    context->peak_attributes = 0;
+    context->peak_markers = 0;
+    context->peak_depth = 0;
+}
+
+// NOTE(mattg): Used for the first call on a context, these are rough upper
+// bounds of what USFM needs, anything more grows a block at a time.
+static uint32_t CSFM_Context_initialCapacity(uint32_t size, uint32_t divisor) {
+    uint32_t capacity = size / divisor + 16;
+    return capacity > CSFM_CONTEXT_MIN_CAPACITY ? capacity : CSFM_CONTEXT_MIN_CAPACITY;
+}
+
+CSFM_TokenResult CSFM_Context_tokenize(CSFM_Context *context, uint8_t *buf, uint32_t size, CSFM_Options options) {
+    CSFM_TokenResult result = {
+        .input = {
+            .ptr = buf,
+            .length = size,
+        },
+    };
+    if (context == NULL) {
+        return result;
+    }
+    CSFM_Context_endCall(context);
+    CSFM_TokenArray_reuse(&context->tokens);
+    if (context->tokens.blocks == NULL) {
+        result.error = CSFM_TokenArray_allocate(&context->tokens, CSFM_Context_initialCapacity(size, 2));
+        if (result.error != CSFM_ERROR_SUCCESS) {
+            return result;
+        }
+    }
+
+    result.tokens = context->tokens;
+    CSFM_tokenizeInto(&result, options);
+    // NOTE(mattg): Pushing may have grown the directory.
+    context->tokens = result.tokens;
+    return result;
+}
+
+CSFM_ParseResult CSFM_Context_parse(CSFM_Context *context, uint8_t *buf, uint32_t size, CSFM_Options options) {
+    CSFM_ParseResult result = {
+        .input = {
+            .ptr = buf,
+            .length = size,
+        },
+    };
+    if (context == NULL) {
+        return result;
+    }
+    CSFM_TRACE_BEGIN(parse);
+    CSFM_Context_endCall(context);
+    CSFM_NodeArray_reuse(&context->tree);
+    context->diagnostics.length = 0;
+    if (context->tree.blocks == NULL) {
+        result.error = CSFM_NodeArray_allocate(&context->tree, CSFM_Context_initialCapacity(size, 4));
+        if (result.error != CSFM_ERROR_SUCCESS) {
+            return result;
+        }
+    }
+
+    result.tree = context->tree;
+    result.diagnostics = context->diagnostics;
+    if ((options.flags & CSFM_OPTION_POSTING_LISTS) != 0) {
+        result.postings = context->postings;
+    }
+    if ((options.flags & CSFM_OPTION_ATTRIBUTES) != 0) {
+        result.attributes = context->attributes;
+    }
+    CSFM_parseInto(&result, options, context);
+    context->tree = result.tree;
+    context->diagnostics = result.diagnostics;
+    if ((options.flags & CSFM_OPTION_POSTING_LISTS) != 0) {
+        context->postings = result.postings;
+    }
+    if ((options.flags & CSFM_OPTION_ATTRIBUTES) != 0) {
+        context->attributes = result.attributes;
+    }
+    CSFM_TRACE_END(parse, NULL, size);
+    return result;
+}
+
+// NOTE(mattg): Only a `\c` followed by whitespace (or the end) starts a
+// chapter, `\cl`, `\cp`, `\cd`, `\ca` and `\cat` don't.
+static inline bool CSFM_isChapterMarker(const uint8_t *ptr, uint32_t length, uint32_t index) {
+    if (index + 1 >= length || ptr[index + 1] != 'c') {
+        return false;
+    }
+    if (index + 2 == length) {
+        return true;
+    }
+    uint8_t next = ptr[index + 2];
+    return next == ' ' || next == '\t' || next == '\r' || next == '\n';
+}
+
+CSFM_ErrorType CSFM_LazyDocument_open(
+    CSFM_LazyDocument *document, uint8_t *buf, uint32_t size, CSFM_Options options, uint32_t maxResident
+) {
+    if (document == NULL) {
+        return CSFM_ERROR_SUCCESS;
+    }
+    memset(document, 0, sizeof(CSFM_LazyDocument));
+    document->input.ptr = buf;
+    document->input.length = size;
+    document->options = options;
+    document->max_resident = maxResident > 0 ? maxResident : 1;
+    document->newest = UINT32_MAX;
+    document->oldest = UINT32_MAX;
+    CSFM_Context_init(&document->context);
+
+    uint32_t capacity = 0;
+    uint32_t start = 0;
+    uint32_t number = 0;
+    uint32_t index = 0;
+    for (;;) {
+        const uint8_t *marker = index < size ? memchr(&buf[index], '\\', size - index) : NULL;
+        uint32_t next = marker == NULL ? size : (uint32_t)(marker - buf);
+        if (marker != NULL && !CSFM_isChapterMarker(buf, size, next)) {
+            index = next + 1;
+            continue;
+        }
+
+        CSFM_ErrorType error = CSFM_reserve((void **)&document->chapters, &capacity, document->chapter_count + 1, sizeof(CSFM_Chapter));
+        if (error != CSFM_ERROR_SUCCESS) {
+            CSFM_LazyDocument_deallocate(document);
+            return error;
+        }
+        CSFM_Chapter chapter = {
+            .start = start,
+            .end = next,
+            .number = number,
+            .newer = UINT32_MAX,
+            .older = UINT32_MAX,
+        };
+        document->chapters[document->chapter_count++] = chapter;
+        if (marker == NULL) {
+            break;
+        }
+
+        start = next;
+        index = next + 2;
+        while (index < size && (buf[index] == ' ' || buf[index] == '\t')) {
+            index++;
+        }
+        number = 0;
+        while (index < size && buf[index] >= '0' && buf[index] <= '9') {
+            number = number * 10 + (uint32_t)(buf[index] - '0');
+            index++;
+        }
+    }
+    return CSFM_ERROR_SUCCESS;
+}
+
+void CSFM_LazyDocument_deallocate(CSFM_LazyDocument *document) {
+    if (document == NULL) {
+        return;
+    }
+    CSFM_LazyDocument_evictAll(document);
+    free(document->chapters);
+    document->chapters = NULL;
+    document->chapter_count = 0;
+    CSFM_Context_deallocate(&document->context);
+}
+
+uint32_t CSFM_LazyDocument_find(const CSFM_LazyDocument *document, uint32_t number) {
+    if (document == NULL) {
+        return UINT32_MAX;
+    }
+    for (uint32_t i = 0; i < document->chapter_count; i++) {
+        if (document->chapters[i].number == number) {
+            return i;
+        }
+    }
+    return UINT32_MAX;
+}
+
+static void CSFM_LazyDocument_unlink(CSFM_LazyDocument *document, uint32_t index) {
+    CSFM_Chapter *chapter = &document->chapters[index];
+    if (chapter->newer != UINT32_MAX) {
+        document->chapters[chapter->newer].older = chapter->older;
+    } else {
+        document->newest = chapter->older;
+    }
+    if (chapter->older != UINT32_MAX) {
+        document->chapters[chapter->older].newer = chapter->newer;
+    } else {
+        document->oldest = chapter->newer;
+    }
+    chapter->newer = UINT32_MAX;
+    chapter->older = UINT32_MAX;
+}
+
+static void CSFM_LazyDocument_pushNewest(CSFM_LazyDocument *document, uint32_t index) {
+    CSFM_Chapter *chapter = &document->chapters[index];
+    chapter->newer = UINT32_MAX;
+    chapter->older = document->newest;
+    if (document->newest != UINT32_MAX) {
+        document->chapters[document->newest].newer = index;
+    } else {
+        document->oldest = index;
+    }
+    document->newest = index;
+}
+
+// Copies `length` elements into an exactly sized buffer, NULL for nothing.
+static void *CSFM_duplicate(const void *buffer, uint32_t length, uint32_t elementSize, CSFM_ErrorType *error) {
+    if (length == 0 || buffer == NULL) {
+        return NULL;
+    }
+    void *copy = malloc((size_t)length * elementSize);
+    if (copy == NULL) {
+        *error = CSFM_ERROR_OUT_OF_MEMORY;
+        return NULL;
+    }
+    memcpy(copy, buffer, (size_t)length * elementSize);
+    return copy;
+}
+
+// Takes a result that borrows the context's buffers and gives it buffers
+// of its own, sized to fit (the tree to the block), so resident chapters
+// hold no slack.
+static CSFM_ParseResult CSFM_ParseResult_detach(CSFM_ParseResult borrowed) {
+    CSFM_ParseResult owned = {
+        .input = borrowed.input,
+        .error = borrowed.error,
+        .error_offset = borrowed.error_offset,
+    };
+    CSFM_ErrorType error = CSFM_ERROR_SUCCESS;
+    if (CSFM_NodeArray_copy(&owned.tree, &borrowed.tree) != CSFM_ERROR_SUCCESS) {
+        error = CSFM_ERROR_OUT_OF_MEMORY;
+    }
+    owned.diagnostics.buffer = CSFM_duplicate(borrowed.diagnostics.buffer, borrowed.diagnostics.length, sizeof(CSFM_Diagnostic), &error);
+    owned.diagnostics.length = owned.diagnostics.capacity = owned.diagnostics.buffer != NULL ? borrowed.diagnostics.length : 0;
+    owned.attributes.buffer = CSFM_duplicate(borrowed.attributes.buffer, borrowed.attributes.length, sizeof(CSFM_Attribute), &error);
+    owned.attributes.length = owned.attributes.capacity = owned.attributes.buffer != NULL ? borrowed.attributes.length : 0;
+    CSFM_IndexArray *from[2] = { &borrowed.postings.nodes, &borrowed.postings.offsets };
+    CSFM_IndexArray *to[2] = { &owned.postings.nodes, &owned.postings.offsets };
+    for (uint32_t i = 0; i < 2; i++) {
+        to[i]->buffer = CSFM_duplicate(from[i]->buffer, from[i]->length, sizeof(uint32_t), &error);
+        to[i]->length = to[i]->capacity = to[i]->buffer != NULL ? from[i]->length : 0;
+    }
+    if (error != CSFM_ERROR_SUCCESS) {
+        CSFM_ParseResult_deallocate(&owned);
+        memset(&owned, 0, sizeof(CSFM_ParseResult));
+        owned.input = borrowed.input;
+        owned.error = error;
+    }
+    return owned;
+}
+
+const CSFM_ParseResult *CSFM_LazyDocument_chapter(CSFM_LazyDocument *document, uint32_t index) {
+    if (document == NULL || index >= document->chapter_count) {
+        return NULL;
+    }
+    CSFM_Chapter *chapter = &document->chapters[index];
+    if (chapter->resident) {
+        CSFM_LazyDocument_unlink(document, index);
+        CSFM_LazyDocument_pushNewest(document, index);
+        return &chapter->result;
+    }
+
+    while (document->resident >= document->max_resident && document->oldest != UINT32_MAX) {
+        CSFM_LazyDocument_evict(document, document->oldest);
+    }
+    CSFM_ParseResult borrowed = CSFM_Context_parse(
+        &document->context, &document->input.ptr[chapter->start], chapter->end - chapter->start, document->options
+    );
+    chapter->result = CSFM_ParseResult_detach(borrowed);
+    if (chapter->result.error == CSFM_ERROR_OUT_OF_MEMORY) {
+        // NOTE(mattg): Keep failures out of the cache. The chapter stays
+        // non-resident and owns nothing, so a later call parses it again.
+        CSFM_ParseResult_deallocate(&chapter->result);
+        memset(&chapter->result, 0, sizeof(CSFM_ParseResult));
+        chapter->result.input = borrowed.input;
+        chapter->result.error = CSFM_ERROR_OUT_OF_MEMORY;
+        return &chapter->result;
+    }
+    chapter->resident = true;
+    document->resident++;
+    CSFM_LazyDocument_pushNewest(document, index);
+    return &chapter->result;
+}
+
+void CSFM_LazyDocument_evict(CSFM_LazyDocument *document, uint32_t index) {
+    if (document == NULL || index >= document->chapter_count || !document->chapters[index].resident) {
+        return;
+    }
+    CSFM_Chapter *chapter = &document->chapters[index];
+    CSFM_LazyDocument_unlink(document, index);
+    CSFM_ParseResult_deallocate(&chapter->result);
+    memset(&chapter->result, 0, sizeof(CSFM_ParseResult));
+    chapter->resident = false;
+    document->resident--;
+}
+
+void CSFM_LazyDocument_evictAll(CSFM_LazyDocument *document) {
+    if (document == NULL) {
+        return;
+    }
+    while (document->newest != UINT32_MAX) {
+        CSFM_LazyDocument_evict(document, document->newest);
+    }
+}
+
+void CSFM_PostingLists_deallocate(CSFM_PostingLists *postings) {
+    if (postings == NULL) {
+        return;
+    }
+    CSFM_IndexArray_deallocate(&postings->nodes);
+    CSFM_IndexArray_deallocate(&postings->offsets);
+}
+
+uint32_t CSFM_PostingLists_count(const CSFM_PostingLists *postings, CSFM_Marker marker) {
+    if (postings == NULL || postings->offsets.length != CSFM_MARKER_COUNT + 1 || (uint32_t)marker >= CSFM_MARKER_COUNT) {
+        return 0;
+    }
+    return postings->offsets.buffer[marker + 1] - postings->offsets.buffer[marker];
+}
+
+uint32_t CSFM_PostingLists_get(const CSFM_PostingLists *postings, CSFM_Marker marker, uint32_t index) {
+    if (index >= CSFM_PostingLists_count(postings, marker)) {
+        return UINT32_MAX;
+    }
+    return postings->nodes.buffer[postings->offsets.buffer[marker] + index];
+}
+
+static bool CSFM_Node_isClose(const CSFM_Node *node) {
+    return node->marker_type == CSFM_MARKER_TYPE_CLOSE || node->marker_type == CSFM_MARKER_TYPE_NESTED_CLOSE;
+}
+
+// Block level markers end every span that is not a chapter.
+static bool CSFM_MarkerKind_isBlock(CSFM_MarkerKind kind) {
+    return kind == CSFM_MARKER_KIND_HEADER || kind == CSFM_MARKER_KIND_PARAGRAPH || kind == CSFM_MARKER_KIND_CHAPTER;
+}
+
+CSFM_NodeRange CSFM_MarkerSpan(const CSFM_ParseResult *result, uint32_t nodeIndex) {
+    CSFM_NodeRange range = {
+        .first = nodeIndex,
+        .end = nodeIndex,
+    };
+    if (result == NULL || nodeIndex >= result->tree.length) {
+        return range;
+    }
+    range.end = nodeIndex + 1;
+    const CSFM_Node *open = CSFM_NodeArray_at(&result->tree, nodeIndex);
+    if (open->type != CSFM_NODE_MARKER || CSFM_Node_isClose(open)) {
+        return range;
+    }
+
+    CSFM_MarkerKind kind = CSFM_Marker_kind(open->marker);
+    if (kind == CSFM_MARKER_KIND_MILESTONE) {
+        // NOTE(mattg): `-s` runs to the matching `-e`, `-e` is on its own.
+        if (result->input.ptr[open->end - 1] != 's') {
+            return range;
+        }
+        for (uint32_t i = nodeIndex + 1; i < result->tree.length; i++) {
+            const CSFM_Node *node = CSFM_NodeArray_at(&result->tree, i);
+            if (node->type == CSFM_NODE_MARKER && node->marker == open->marker &&
+                result->input.ptr[node->end - 1] == 'e') {
+                range.end = i + 1;
+                return range;
+            }
+        }
+        return range;
+    }
+
+    uint32_t i = nodeIndex + 1;
+    for (; i < result->tree.length; i++) {
+        const CSFM_Node *node = CSFM_NodeArray_at(&result->tree, i);
+        if (node->type != CSFM_NODE_MARKER) {
+            continue;
+        }
+        CSFM_MarkerKind nodeKind = CSFM_Marker_kind(node->marker);
+        bool close = CSFM_Node_isClose(node);
+        switch (kind) {
+        case CSFM_MARKER_KIND_CHAPTER:
+            if (nodeKind == CSFM_MARKER_KIND_CHAPTER && !close) {
+                range.end = i;
+                return range;
+            }
+            break;
+        case CSFM_MARKER_KIND_VERSE:
+            if ((nodeKind == CSFM_MARKER_KIND_VERSE || nodeKind == CSFM_MARKER_KIND_CHAPTER) && !close) {
+                range.end = i;
+                return range;
+            }
+            break;
+        case CSFM_MARKER_KIND_HEADER:
+        case CSFM_MARKER_KIND_PARAGRAPH:
+            if (CSFM_MarkerKind_isBlock(nodeKind) && !close) {
+                range.end = i;
+                return range;
+            }
+            break;
+        case CSFM_MARKER_KIND_NOTE_CHARACTER:
+            if (close && (node->marker == open->marker || nodeKind == CSFM_MARKER_KIND_NOTE)) {
+                // NOTE(mattg): Our own close belongs to us, the note's does not.
+                range.end = node->marker == open->marker ? i + 1 : i;
+                return range;
+            }
+            if (!close && nodeKind == CSFM_MARKER_KIND_NOTE_CHARACTER && node->marker_type == CSFM_MARKER_TYPE_NORMAL) {
+                range.end = i;
+                return range;
+            }
+            if (CSFM_MarkerKind_isBlock(nodeKind)) {
+                range.end = i;
+                return range;
+            }
+            break;
+        default:
+            if (close && node->marker == open->marker) {
+                bool unknown = open->marker == CSFM_MARKER_UNKNOWN;
+                uint32_t length = open->marker_text_end - open->marker_text_start;
+                if (!unknown || (
+                    length == node->marker_text_end - node->marker_text_start &&
+                    memcmp(&result->input.ptr[open->marker_text_start], &result->input.ptr[node->marker_text_start], length) == 0
+                )) {
+                    range.end = i + 1;
+                    return range;
+                }
+            }
+            if (CSFM_MarkerKind_isBlock(nodeKind) && !close) {
+                range.end = i;
+                return range;
+            }
+            break;
+        }
+    }
+    range.end = i;
+    return range;
+}
+
+CSFM_MarkerQuery CSFM_MarkerQuery_begin(const CSFM_ParseResult *result, CSFM_Marker marker) {
+    CSFM_MarkerQuery query = {
+        .result = result,
+        .marker = marker,
+        .position = 0,
+    };
+    return query;
+}
+
+bool CSFM_MarkerQuery_next(CSFM_MarkerQuery *query, CSFM_NodeRange *span) {
+    if (query == NULL || query->result == NULL) {
+        return false;
+    }
+    uint32_t nodeIndex = CSFM_PostingLists_get(&query->result->postings, query->marker, query->position);
+    if (nodeIndex == UINT32_MAX) {
+        return false;
+    }
+    query->position++;
+    if (span != NULL) {
+        *span = CSFM_MarkerSpan(query->result, nodeIndex);
+    }
+    return true;
+}
+
+static const CSFM_Marker CSFM_EXTRACT_DROPPED[] = {
+    CSFM_MARKER_rem,
+    CSFM_MARKER_ms, CSFM_MARKER_mr, CSFM_MARKER_s, CSFM_MARKER_sr, CSFM_MARKER_r, CSFM_MARKER_rq,
+    CSFM_MARKER_sp, CSFM_MARKER_sd, CSFM_MARKER_qa,
+    CSFM_MARKER_ca, CSFM_MARKER_cl, CSFM_MARKER_cp, CSFM_MARKER_cd, CSFM_MARKER_va, CSFM_MARKER_vp,
+    CSFM_MARKER_f, CSFM_MARKER_fe, CSFM_MARKER_x, CSFM_MARKER_ef, CSFM_MARKER_ex,
+    CSFM_MARKER_fig, CSFM_MARKER_cat,
+};
+
+void CSFM_VerseExtractor_init(CSFM_VerseExtractor *extractor) {
+    if (extractor == NULL) {
+        return;
+    }
+    memset(extractor, 0, sizeof(CSFM_VerseExtractor));
+    for (uint32_t m = 0; m < CSFM_MARKER_COUNT; m++) {
+        // NOTE(mattg): Only the book name after `\id` is wanted, and
+        // introductions come before the first verse anyway.
+        extractor->drop[m] = CSFM_Marker_kind((CSFM_Marker)m) == CSFM_MARKER_KIND_HEADER;
+    }
+    for (uint32_t i = 0; i < sizeof(CSFM_EXTRACT_DROPPED) / sizeof(CSFM_EXTRACT_DROPPED[0]); i++) {
+        extractor->drop[CSFM_EXTRACT_DROPPED[i]] = true;
+    }
+}
+
+void CSFM_VerseExtractor_deallocate(CSFM_VerseExtractor *extractor) {
+    if (extractor == NULL) {
+        return;
+    }
+    free(extractor->buffer);
+    extractor->buffer = NULL;
+    extractor->length = 0;
+    extractor->capacity = 0;
+}
+
+static inline bool CSFM_isTextSpace(uint8_t c) {
+    return c == ' ' || c == '\t';
+}
+
+// Appends one span of text in a single copy. Whitespace at the seam is
+// collapsed so the verse never holds two spaces in a row across nodes.
+static CSFM_ErrorType CSFM_VerseExtractor_append(
+    CSFM_VerseExtractor *extractor, const uint8_t *ptr, uint32_t length, bool space
+) {
+    bool atSpace = extractor->length == 0 || extractor->buffer[extractor->length - 1] == ' ';
+    if (atSpace || space) {
+        while (length > 0 && CSFM_isTextSpace(*ptr)) {
+            ptr++;
+            length--;
+        }
+    }
+    if (length == 0) {
+        return CSFM_ERROR_SUCCESS;
+    }
+    uint32_t needed = extractor->length + length + 1;
+    if (needed > extractor->capacity) {
+        uint32_t newCapacity = extractor->capacity == 0 ? 256 : extractor->capacity;
+        while (newCapacity < needed) {
+            newCapacity *= 2;
+        }
+        uint8_t *newBuffer = realloc(extractor->buffer, newCapacity);
+        if (newBuffer == NULL) {
+            return CSFM_ERROR_OUT_OF_MEMORY;
+        }
+        extractor->buffer = newBuffer;
+        extractor->capacity = newCapacity;
+    }
+    if (space && !atSpace) {
+        extractor->buffer[extractor->length++] = ' ';
+    }
+    memcpy(&extractor->buffer[extractor->length], ptr, length);
+    extractor->length += length;
+    return CSFM_ERROR_SUCCESS;
+}
+
+// Index of the first TEXT node after `nodeIndex`, skipping whitespace, or
+// UINT32_MAX if something else comes first.
+static uint32_t CSFM_nextTextNode(const CSFM_ParseResult *result, uint32_t nodeIndex) {
+    for (uint32_t i = nodeIndex + 1; i < result->tree.length; i++) {
+        CSFM_NodeType type = CSFM_NodeArray_at(&result->tree, i)->type;
+        if (type == CSFM_NODE_TEXT) {
+            return i;
+        }
+        if (type != CSFM_NODE_WHITESPACE) {
+            break;
+        }
+    }
+    return UINT32_MAX;
+}
+
+// Splits the first word off a TEXT node, `*rest` is where the remainder starts.
+static CSFM_String8Slice CSFM_firstWord(CSFM_String8Slice input, const CSFM_Node *node, uint32_t *rest) {
+    uint32_t i = node->start;
+    while (i < node->end && CSFM_isTextSpace(input.ptr[i])) {
+        i++;
+    }
+    uint32_t start = i;
+    while (i < node->end && !CSFM_isTextSpace(input.ptr[i])) {
+        i++;
+    }
+    *rest = i;
+    CSFM_String8Slice word = {
+        .ptr = &input.ptr[start],
+        .length = i - start,
+    };
+    return word;
+}
+
+CSFM_ErrorType CSFM_VerseExtractor_run(
+    CSFM_VerseExtractor *extractor, const CSFM_ParseResult *result, CSFM_VerseCallback callback, void *user
+) {
+    if (extractor == NULL || result == NULL || callback == NULL) {
+        return CSFM_ERROR_SUCCESS;
+    }
+    CSFM_String8Slice input = result->input;
+    CSFM_VerseRecord record = {0};
+    CSFM_ErrorType error = CSFM_ERROR_SUCCESS;
+    bool inVerse = false;
+    bool space = false;
+    extractor->length = 0;
+    CSFM_TRACE_BEGIN(emit);
+
+    uint32_t i = 0;
+    while (i < result->tree.length) {
+        const CSFM_Node *node = CSFM_NodeArray_at(&result->tree, i);
+        switch (node->type) {
+        case CSFM_NODE_TEXT:
+            if (inVerse) {
+                error = CSFM_VerseExtractor_append(extractor, &input.ptr[node->start], node->end - node->start, space);
+                space = false;
+            }
+            i++;
+            break;
+        case CSFM_NODE_WHITESPACE:
+        case CSFM_NODE_NEWLINE:
+            space = true;
+            i++;
+            break;
+        case CSFM_NODE_MARKER: {
+            if (CSFM_Node_isClose(node)) {
+                i++;
+                break;
+            }
+            CSFM_MarkerKind kind = CSFM_Marker_kind(node->marker);
+            uint32_t text = UINT32_MAX;
+            uint32_t rest = 0;
+            if (kind == CSFM_MARKER_KIND_CHAPTER || kind == CSFM_MARKER_KIND_VERSE) {
+                if (inVerse) {
+                    while (extractor->length > 0 && extractor->buffer[extractor->length - 1] == ' ') {
+                        extractor->length--;
+                    }
+                    record.text.ptr = extractor->buffer;
+                    record.text.length = extractor->length;
+                    callback(user, &record);
+                }
+                extractor->length = 0;
+                space = false;
+                text = CSFM_nextTextNode(result, i);
+            }
+
+            if (node->marker == CSFM_MARKER_id) {
+                text = CSFM_nextTextNode(result, i);
+                if (text != UINT32_MAX) {
+                    record.book = CSFM_firstWord(input, CSFM_NodeArray_at(&result->tree, text), &rest);
+                }
+            } else if (kind == CSFM_MARKER_KIND_CHAPTER) {
+                inVerse = false;
+                record.chapter = 0;
+                if (text != UINT32_MAX) {
+                    CSFM_String8Slice number = CSFM_firstWord(input, CSFM_NodeArray_at(&result->tree, text), &rest);
+                    for (uint32_t d = 0; d < number.length && number.ptr[d] >= '0' && number.ptr[d] <= '9'; d++) {
+                        record.chapter = record.chapter * 10 + (uint32_t)(number.ptr[d] - '0');
+                    }
+                    i = text + 1;
+                    break;
+                }
+            } else if (kind == CSFM_MARKER_KIND_VERSE) {
+                inVerse = true;
+                record.verse.ptr = &input.ptr[node->end];
+                record.verse.length = 0;
+                if (text != UINT32_MAX) {
+                    const CSFM_Node *textNode = CSFM_NodeArray_at(&result->tree, text);
+                    record.verse = CSFM_firstWord(input, textNode, &rest);
+                    error = CSFM_VerseExtractor_append(extractor, &input.ptr[rest], textNode->end - rest, false);
+                    i = text + 1;
+                    break;
+                }
+            }
+
+            if (!extractor->drop[node->marker]) {
+                space = space || CSFM_MarkerKind_isBlock(kind);
+                i++;
+                break;
+            }
+            // NOTE(mattg): A dropped span never swallows the next verse, even
+            // when a heading or an unclosed note runs into it.
+            CSFM_NodeRange span = CSFM_MarkerSpan(result, i);
+            uint32_t end = i + 1;
+            while (end < span.end) {
+                const CSFM_Node *inner = CSFM_NodeArray_at(&result->tree, end);
+                if (inner->type == CSFM_NODE_MARKER && !CSFM_Node_isClose(inner)) {
+                    CSFM_MarkerKind innerKind = CSFM_Marker_kind(inner->marker);
+                    if (innerKind == CSFM_MARKER_KIND_VERSE || innerKind == CSFM_MARKER_KIND_CHAPTER) {
+                        break;
+                    }
+                }
+                end++;
+            }
+            space = space || CSFM_MarkerKind_isBlock(kind);
+            i = end;
+            break;
+        }
+        default:
+            i++;
+            break;
+        }
+        if (error != CSFM_ERROR_SUCCESS) {
+            return error;
+        }
+    }
+
+    if (inVerse) {
+        while (extractor->length > 0 && extractor->buffer[extractor->length - 1] == ' ') {
+            extractor->length--;
+        }
+        record.text.ptr = extractor->buffer;
+        record.text.length = extractor->length;
+        callback(user, &record);
+    }
+    CSFM_TRACE_END(emit, NULL, input.length);
+    return CSFM_ERROR_SUCCESS;
+}
+
+void CSFM_VerseRecord_writeTSV(void *user, const CSFM_VerseRecord *record) {
+    FILE *file = user;
+    fprintf(file, "%.*s\t%u\t%.*s\t",
+        (int)record->book.length, (const char *)record->book.ptr,
+        record->chapter,
+        (int)record->verse.length, (const char *)record->verse.ptr);
+    const uint8_t *ptr = record->text.ptr;
+    uint32_t remaining = record->text.length;
+    while (remaining > 0) {
+        const uint8_t *tab = memchr(ptr, '\t', remaining);
+        uint32_t run = tab == NULL ? remaining : (uint32_t)(tab - ptr);
+        fwrite(ptr, 1, run, file);
+        if (tab == NULL) {
+            break;
+        }
+        fputc(' ', file);
+        ptr += run + 1;
+        remaining -= run + 1;
+    }
+    fputc('\n', file);
+}
+
+static void CSFM_writeU32(FILE *file, uint32_t value) {
+    uint8_t bytes[4] = {
+        (uint8_t)value,
+        (uint8_t)(value >> 8),
+        (uint8_t)(value >> 16),
+        (uint8_t)(value >> 24),
+    };
+    fwrite(bytes, 1, 4, file);
+}
+
+void CSFM_VerseRecord_writeBinary(void *user, const CSFM_VerseRecord *record) {
+    FILE *file = user;
+    CSFM_writeU32(file, record->book.length);
+    fwrite(record->book.ptr, 1, record->book.length, file);
+    CSFM_writeU32(file, record->chapter);
+    CSFM_writeU32(file, record->verse.length);
+    fwrite(record->verse.ptr, 1, record->verse.length, file);
+    CSFM_writeU32(file, record->text.length);
+    fwrite(record->text.ptr, 1, record->text.length, file);
+}
+
+// Runs `run(work)` on up to `threads` threads, the calling one included, and
+// waits for all of them. `run` pulls its items off a shared counter, so
+// there is no point in more threads than `items`.
+static void CSFM_runWorkers(uint32_t threads, uint32_t items, void *(*run)(void *), void *work) {
+#if defined(CSFM_THREADS)
+    threads = threads < items ? threads : items;
+    pthread_t *workers = threads > 1 ? malloc(sizeof(pthread_t) * threads) : NULL;
+    uint32_t started = 0;
+    if (workers != NULL) {
+        // NOTE(mattg): The calling thread works too, so one less is started.
+        for (; started < threads - 1; started++) {
+            if (pthread_create(&workers[started], NULL, run, work) != 0) {
+                break;
+            }
+        }
+    }
+    run(work);
+    for (uint32_t t = 0; t < started; t++) {
+        pthread_join(workers[t], NULL);
+    }
+    free(workers);
+#else
+    (void)threads;
+    (void)items;
+    run(work);
+#endif
+}
+
+// Decodes the sequence at `ptr[index]`, which CSFM_UTF8_sequenceLength says
+// is `sequenceLength` bytes long and well-formed.
+static inline uint32_t CSFM_UTF8_decode(const uint8_t *ptr, uint32_t index, uint32_t sequenceLength) {
+    switch (sequenceLength) {
+    case 1:
+        return ptr[index];
+    case 2:
+        return ((uint32_t)(ptr[index] & 0x1F) << 6) | (ptr[index + 1] & 0x3F);
+    case 3:
+        return ((uint32_t)(ptr[index] & 0x0F) << 12) | ((uint32_t)(ptr[index + 1] & 0x3F) << 6) |
+            (ptr[index + 2] & 0x3F);
+    default:
+        return ((uint32_t)(ptr[index] & 0x07) << 18) | ((uint32_t)(ptr[index + 1] & 0x3F) << 12) |
+            ((uint32_t)(ptr[index + 2] & 0x3F) << 6) | (ptr[index + 3] & 0x3F);
+    }
+}
+
+typedef enum {
+    CSFM_WORD_NONE,
+    CSFM_WORD_PART,
+    // A word of its own, e.g. a CJK ideograph.
+    CSFM_WORD_SINGLE,
+} CSFM_WordClass;
+
+static CSFM_WordClass CSFM_wordClass(uint32_t cp) {
+    if (cp < 0x80) {
+        bool alnum = (cp >= '0' && cp <= '9') || (cp >= 'a' && cp <= 'z') || (cp >= 'A' && cp <= 'Z');
+        return alnum ? CSFM_WORD_PART : CSFM_WORD_NONE;
+    }
+    if (cp < 0xC0) {
+        // NOTE(mattg): Latin-1 punctuation and symbols, except for ª µ º.
+        return cp == 0xAA || cp == 0xB5 || cp == 0xBA ? CSFM_WORD_PART : CSFM_WORD_NONE;
+    }
+    if (cp == 0xD7 || cp == 0xF7) {
+        return CSFM_WORD_NONE;
+    }
+    // Punctuation outside of the general blocks, Armenian, Hebrew (maqaf,
+    // paseq, sof pasuq), Arabic, Devanagari dandas.
+    if (cp == 0x0589 || cp == 0x05BE || cp == 0x05C0 || cp == 0x05C3 || cp == 0x060C || cp == 0x061B ||
+        cp == 0x061F || cp == 0x06D4 || cp == 0x0964 || cp == 0x0965) {
+        return CSFM_WORD_NONE;
+    }
+    // General punctuation, super/subscripts, currency, arrows, math, boxes,
+    // dingbats and CJK punctuation.
+    if ((cp >= 0x2000 && cp <= 0x2BFF) || (cp >= 0x2E00 && cp <= 0x2E7F) || (cp >= 0x3000 && cp <= 0x303F)) {
+        return CSFM_WORD_NONE;
+    }
+    if ((cp >= 0xFE30 && cp <= 0xFE4F) || (cp >= 0xFF00 && cp <= 0xFF0F) || (cp >= 0xFF1A && cp <= 0xFF20) ||
+        (cp >= 0xFF3B && cp <= 0xFF40) || (cp >= 0xFF5B && cp <= 0xFF65) || cp == 0xFEFF || cp == 0xFFFD) {
+        return CSFM_WORD_NONE;
+    }
+    if ((cp >= 0x3400 && cp <= 0x4DBF) || (cp >= 0x4E00 && cp <= 0x9FFF) || (cp >= 0xF900 && cp <= 0xFAFF) ||
+        (cp >= 0x20000 && cp <= 0x3134F)) {
+        return CSFM_WORD_SINGLE;
+    }
+    return CSFM_WORD_PART;
+}
+
+// Simple case folding for Latin, Greek and Cyrillic. Every mapping stays
+// inside the same UTF-8 length, so words can be folded in place.
+static uint32_t CSFM_foldCase(uint32_t cp) {
+    if (cp < 0x80) {
+        return cp >= 'A' && cp <= 'Z' ? cp + 0x20 : cp;
+    }
+    if (cp >= 0xC0 && cp <= 0xDE && cp != 0xD7) {
+        return cp + 0x20;
+    }
+    if (cp >= 0x0100 && cp <= 0x017F) {
+        if (cp == 0x0130 || cp == 0x0131 || cp == 0x0138 || cp == 0x0149 || cp == 0x017F) {
+            return cp;
+        }
+        if (cp == 0x0178) {
+            return 0xFF;
+        }
+        // NOTE(mattg): Upper case is even up to U+0137, odd from U+0139 to
+        // U+0148, even again to U+0177 and odd after that.
+        bool upperIsOdd = (cp >= 0x0139 && cp <= 0x0148) || cp >= 0x0179;
+        return (cp & 1) == (upperIsOdd ? 1u : 0u) ? cp + 1 : cp;
+    }
+    if (cp >= 0x0370 && cp <= 0x03FF) {
+        if ((cp >= 0x0391 && cp <= 0x03AB && cp != 0x03A2)) {
+            return cp + 0x20;
+        }
+        switch (cp) {
+        case 0x0386:
+            return 0x03AC;
+        case 0x0388:
+        case 0x0389:
+        case 0x038A:
+            return cp + 0x25;
+        case 0x038C:
+            return 0x03CC;
+        case 0x038E:
+        case 0x038F:
+            return cp + 0x3F;
+        case 0x03C2:
+            // final sigma
+            return 0x03C3;
+        default:
+            return cp;
+        }
+    }
+    if (cp >= 0x0410 && cp <= 0x042F) {
+        return cp + 0x20;
+    }
+    if (cp >= 0x0400 && cp <= 0x040F) {
+        return cp + 0x50;
+    }
+    return cp;
+}
+
+// Finds the next word at or after `*index` and writes it folded to `out`,
+// which needs room for `length - *index` bytes. Returns the folded length,
+// 0 once there are no more words.
+static uint32_t CSFM_nextWord(const uint8_t *text, uint32_t length, uint32_t *index, uint8_t *out) {
+    uint32_t i = *index;
+    uint32_t written = 0;
+    while (i < length) {
+        uint32_t sequenceLength = CSFM_UTF8_sequenceLength(text, length, i);
+        if (sequenceLength == 0) {
+            // invalid bytes separate words
+            i++;
+            if (written > 0) {
+                break;
+            }
+            continue;
+        }
+        uint32_t cp = CSFM_UTF8_decode(text, i, sequenceLength);
+        CSFM_WordClass wordClass = CSFM_wordClass(cp);
+        if (wordClass == CSFM_WORD_NONE || (wordClass == CSFM_WORD_SINGLE && written > 0)) {
+            if (written > 0) {
+                break;
+            }
+            i += sequenceLength;
+            continue;
+        }
+        written += CSFM_UTF8_encode(CSFM_foldCase(cp), &out[written]);
+        i += sequenceLength;
+        if (wordClass == CSFM_WORD_SINGLE) {
+            break;
+        }
+    }
+    *index = i;
+    return written;
+}
+
+static inline uint32_t CSFM_hashBytes(const uint8_t *ptr, uint32_t length) {
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (uint32_t i = 0; i < length; i++) {
+        hash = (hash ^ ptr[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static inline uint32_t CSFM_varintLength(uint32_t value) {
+    uint32_t length = 1;
+    while (value >= 0x80) {
+        value >>= 7;
+        length++;
+    }
+    return length;
+}
+
+static inline uint32_t CSFM_writeVarint(uint8_t *out, uint32_t value) {
+    uint32_t length = 0;
+    while (value >= 0x80) {
+        out[length++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    out[length++] = (uint8_t)value;
+    return length;
+}
+
+// Returns false on a truncated or overlong varint.
+static inline bool CSFM_readVarint(const uint8_t **ptr, const uint8_t *end, uint32_t *value) {
+    uint32_t result = 0;
+    for (uint32_t shift = 0; shift < 35 && *ptr < end; shift += 7) {
+        uint8_t byte = *(*ptr)++;
+        result |= (uint32_t)(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0) {
+            *value = result;
+            return true;
+        }
+    }
+    return false;
+}
+
+static int CSFM_IndexPosting_compare(const CSFM_IndexPosting *a, const CSFM_IndexPosting *b) {
+    if (a->book != b->book) {
+        return a->book < b->book ? -1 : 1;
+    }
+    if (a->chapter != b->chapter) {
+        return a->chapter < b->chapter ? -1 : 1;
+    }
+    if (a->verse != b->verse) {
+        return a->verse < b->verse ? -1 : 1;
+    }
+    if (a->offset != b->offset) {
+        return a->offset < b->offset ? -1 : 1;
+    }
+    return 0;
+}
+
+static int CSFM_IndexPosting_qsortCompare(const void *a, const void *b) {
+    return CSFM_IndexPosting_compare(a, b);
+}
+
+typedef struct {
+    uint32_t string_offset;
+    uint32_t string_length;
+    uint32_t hash;
+    uint32_t count;
+    uint32_t block_offset;
+    uint32_t block_length;
+} CSFM_IndexLocalTerm;
+
+// Everything one book contributes to the index. `postings` holds the term
+// index in `book` while collecting, the book number once encoded.
+typedef struct {
+    const CSFM_ParseResult *result;
+    uint32_t book;
+    CSFM_String8Slice name;
+
+    uint8_t *strings;
+    uint32_t strings_length;
+    uint32_t strings_capacity;
+    CSFM_IndexLocalTerm *terms;
+    uint32_t term_count;
+    uint32_t term_capacity;
+    uint8_t *blocks;
+    uint32_t blocks_length;
+    uint32_t blocks_capacity;
+
+    // term index + 1, 0 is empty
+    uint32_t *slots;
+    uint32_t slot_capacity;
+    CSFM_IndexPosting *postings;
+    uint32_t posting_count;
+    uint32_t posting_capacity;
+    CSFM_ErrorType error;
+} CSFM_IndexBookBuild;
+
+static void CSFM_IndexBookBuild_deallocate(CSFM_IndexBookBuild *build) {
+    free(build->strings);
+    free(build->terms);
+    free(build->blocks);
+    free(build->slots);
+    free(build->postings);
+}
+
+static CSFM_ErrorType CSFM_IndexBookBuild_rehash(CSFM_IndexBookBuild *build) {
+    uint32_t capacity = build->slot_capacity == 0 ? 1024 : build->slot_capacity * 2;
+    uint32_t *slots = calloc(capacity, sizeof(uint32_t));
+    if (slots == NULL) {
+        return CSFM_ERROR_OUT_OF_MEMORY;
+    }
+    for (uint32_t t = 0; t < build->term_count; t++) {
+        uint32_t slot = build->terms[t].hash & (capacity - 1);
+        while (slots[slot] != 0) {
+            slot = (slot + 1) & (capacity - 1);
+        }
+        slots[slot] = t + 1;
+    }
+    free(build->slots);
+    build->slots = slots;
+    build->slot_capacity = capacity;
+    return CSFM_ERROR_SUCCESS;
+}
+
+// Index of the term at the tail of `strings`, adding it if it is new.
+static uint32_t CSFM_IndexBookBuild_intern(CSFM_IndexBookBuild *build, uint32_t length) {
+    if ((build->term_count + 1) * 2 > build->slot_capacity) {
+        build->error = CSFM_IndexBookBuild_rehash(build);
+        if (build->error != CSFM_ERROR_SUCCESS) {
+            return UINT32_MAX;
+        }
+    }
+    const uint8_t *word = &build->strings[build->strings_length];
+    uint32_t hash = CSFM_hashBytes(word, length);
+    uint32_t slot = hash & (build->slot_capacity - 1);
+    while (build->slots[slot] != 0) {
+        const CSFM_IndexLocalTerm *term = &build->terms[build->slots[slot] - 1];
+        if (term->hash == hash && term->string_length == length &&
+            memcmp(&build->strings[term->string_offset], word, length) == 0) {
+            return build->slots[slot] - 1;
+        }
+        slot = (slot + 1) & (build->slot_capacity - 1);
+    }
+
+    build->error = CSFM_reserve((void **)&build->terms, &build->term_capacity, build->term_count + 1, sizeof(CSFM_IndexLocalTerm));
+    if (build->error != CSFM_ERROR_SUCCESS) {
+        return UINT32_MAX;
+    }
+    CSFM_IndexLocalTerm term = {
+        .string_offset = build->strings_length,
+        .string_length = length,
+        .hash = hash,
+    };
+    build->strings_length += length;
+    build->terms[build->term_count] = term;
+    build->slots[slot] = build->term_count + 1;
+    return build->term_count++;
+}
+
+static void CSFM_IndexBookBuild_collect(void *user, const CSFM_VerseRecord *record) {
+    CSFM_IndexBookBuild *build = user;
+    if (build->error != CSFM_ERROR_SUCCESS) {
+        return;
+    }
+    if (build->name.length == 0) {
+        build->name = record->book;
+    }
+    uint32_t verse = 0;
+    for (uint32_t d = 0; d < record->verse.length && record->verse.ptr[d] >= '0' && record->verse.ptr[d] <= '9'; d++) {
+        verse = verse * 10 + (uint32_t)(record->verse.ptr[d] - '0');
+    }
+
+    // NOTE(mattg): Words are folded straight onto the end of the string
+    // pool and only kept there when they turn out to be a new term.
+    build->error = CSFM_reserve((void **)&build->strings, &build->strings_capacity, build->strings_length + record->text.length, 1);
+    if (build->error != CSFM_ERROR_SUCCESS) {
+        return;
+    }
+    uint32_t index = 0;
+    uint32_t offset = 0;
+    for (;;) {
+        uint32_t length = CSFM_nextWord(record->text.ptr, record->text.length, &index, &build->strings[build->strings_length]);
+        if (length == 0) {
+            break;
+        }
+        uint32_t term = CSFM_IndexBookBuild_intern(build, length);
+        if (term == UINT32_MAX) {
+            return;
+        }
+        build->error = CSFM_reserve((void **)&build->postings, &build->posting_capacity, build->posting_count + 1, sizeof(CSFM_IndexPosting));
+        if (build->error != CSFM_ERROR_SUCCESS) {
+            return;
+        }
+        CSFM_IndexPosting posting = {
+            .book = term,
+            .chapter = record->chapter,
+            .verse = verse,
+            .offset = offset++,
+        };
+        build->postings[build->posting_count++] = posting;
+        build->terms[term].count++;
+    }
+}
+
+// Groups the collected postings by term and encodes one block per term.
+static CSFM_ErrorType CSFM_IndexBookBuild_encode(CSFM_IndexBookBuild *build) {
+    CSFM_IndexPosting *sorted = malloc(sizeof(CSFM_IndexPosting) * (build->posting_count + 1));
+    if (sorted == NULL) {
+        return CSFM_ERROR_OUT_OF_MEMORY;
+    }
+    // counting sort, keeps document order inside each term
+    uint32_t start = 0;
+    for (uint32_t t = 0; t < build->term_count; t++) {
+        build->terms[t].block_offset = start;
+        start += build->terms[t].count;
+    }
+    for (uint32_t p = 0; p < build->posting_count; p++) {
+        CSFM_IndexPosting posting = build->postings[p];
+        CSFM_IndexLocalTerm *term = &build->terms[posting.book];
+        posting.book = build->book;
+        sorted[term->block_offset++] = posting;
+    }
+
+    CSFM_ErrorType error = CSFM_ERROR_SUCCESS;
+    uint32_t first = 0;
+    for (uint32_t t = 0; t < build->term_count && error == CSFM_ERROR_SUCCESS; t++) {
+        CSFM_IndexLocalTerm *term = &build->terms[t];
+        CSFM_IndexPosting *postings = &sorted[first];
+        first += term->count;
+        // NOTE(mattg): Only out of order chapters or verses in the source
+        // get here.
+        for (uint32_t p = 1; p < term->count; p++) {
+            if (CSFM_IndexPosting_compare(&postings[p - 1], &postings[p]) > 0) {
+                qsort(postings, term->count, sizeof(CSFM_IndexPosting), CSFM_IndexPosting_qsortCompare);
+                break;
+            }
+        }
+
+        // 3 varints of header, at most 3 per posting
+        uint32_t worst = 15 + term->count * 15;
+        error = CSFM_reserve((void **)&build->blocks, &build->blocks_capacity, build->blocks_length + worst, 1);
+        if (error != CSFM_ERROR_SUCCESS) {
+            break;
+        }
+        uint8_t *out = &build->blocks[build->blocks_length];
+        uint32_t header = CSFM_varintLength(build->book) + CSFM_varintLength(term->count);
+        uint8_t *payload = out + header + 5;
+        uint32_t length = 0;
+        CSFM_IndexPosting previous = {0};
+        for (uint32_t p = 0; p < term->count; p++) {
+            CSFM_IndexPosting posting = postings[p];
+            length += CSFM_writeVarint(&payload[length], posting.chapter - previous.chapter);
+            if (posting.chapter != previous.chapter) {
+                length += CSFM_writeVarint(&payload[length], posting.verse);
+                length += CSFM_writeVarint(&payload[length], posting.offset);
+            } else {
+                length += CSFM_writeVarint(&payload[length], posting.verse - previous.verse);
+                uint32_t offset = posting.verse == previous.verse ? posting.offset - previous.offset : posting.offset;
+                length += CSFM_writeVarint(&payload[length], offset);
+            }
+            previous = posting;
+        }
+
+        uint32_t written = CSFM_writeVarint(out, build->book);
+        written += CSFM_writeVarint(&out[written], term->count);
+        written += CSFM_writeVarint(&out[written], length);
+        memmove(&out[written], payload, length);
+        term->block_offset = build->blocks_length;
+        term->block_length = written + length;
+        build->blocks_length += term->block_length;
+    }
+    free(sorted);
+    return error;
+}
+
+static void CSFM_IndexBookBuild_run(CSFM_IndexBookBuild *build, CSFM_VerseExtractor *extractor) {
+    CSFM_TRACE_BEGIN(index_book);
+    build->error = CSFM_VerseExtractor_run(extractor, build->result, CSFM_IndexBookBuild_collect, build);
+    if (build->error == CSFM_ERROR_SUCCESS) {
+        build->error = CSFM_IndexBookBuild_encode(build);
+    }
+    // NOTE(mattg): Only the terms and blocks are needed for the merge.
+    free(build->slots);
+    free(build->postings);
+    build->slots = NULL;
+    build->postings = NULL;
+    CSFM_TRACE_END(index_book, NULL, build->result->input.length);
+}
+
+typedef struct {
+    CSFM_IndexBookBuild *builds;
+    uint32_t count;
+    uint32_t next;
+} CSFM_IndexWork;
+
+static void *CSFM_IndexWork_run(void *user) {
+    CSFM_IndexWork *work = user;
+    CSFM_VerseExtractor extractor;
+    CSFM_VerseExtractor_init(&extractor);
+    for (;;) {
+        uint32_t book = __atomic_fetch_add(&work->next, 1, __ATOMIC_RELAXED);
+        if (book >= work->count) {
+            break;
+        }
+        CSFM_IndexBookBuild_run(&work->builds[book], &extractor);
+    }
+    CSFM_VerseExtractor_deallocate(&extractor);
+    return NULL;
+}
+
+typedef struct {
+    const uint8_t *ptr;
+    uint32_t length;
+    uint32_t book;
+    uint32_t term;
+} CSFM_IndexMergeEntry;
+
+static int CSFM_IndexMergeEntry_compare(const void *a, const void *b) {
+    const CSFM_IndexMergeEntry *left = a;
+    const CSFM_IndexMergeEntry *right = b;
+    uint32_t length = left->length < right->length ? left->length : right->length;
+    int order = memcmp(left->ptr, right->ptr, length);
+    if (order != 0) {
+        return order;
+    }
+    if (left->length != right->length) {
+        return left->length < right->length ? -1 : 1;
+    }
+    if (left->book != right->book) {
+        return left->book < right->book ? -1 : 1;
+    }
+    return 0;
+}
+
+CSFM_ErrorType CSFM_Index_build(
+    const CSFM_ParseResult *books, uint32_t bookCount, uint32_t threads, CSFM_String8Slice *out
+) {
+    if (out == NULL) {
+        return CSFM_ERROR_SUCCESS;
+    }
+    out->ptr = NULL;
+    out->length = 0;
+    CSFM_IndexBookBuild *builds = calloc(bookCount + 1, sizeof(CSFM_IndexBookBuild));
+    if (builds == NULL) {
+        return CSFM_ERROR_OUT_OF_MEMORY;
+    }
+    for (uint32_t b = 0; b < bookCount; b++) {
+        builds[b].result = &books[b];
+        builds[b].book = b;
+    }
+
+    CSFM_IndexWork work = {
+        .builds = builds,
+        .count = bookCount,
+    };
+    CSFM_runWorkers(threads, bookCount, CSFM_IndexWork_run, &work);
+
+    CSFM_ErrorType error = CSFM_ERROR_SUCCESS;
+    uint32_t entryCount = 0;
+    uint32_t namesLength = 0;
+    for (uint32_t b = 0; b < bookCount; b++) {
+        if (builds[b].error != CSFM_ERROR_SUCCESS) {
+            error = builds[b].error;
+        }
+        entryCount += builds[b].term_count;
+        namesLength += builds[b].name.length;
+    }
+    CSFM_IndexMergeEntry *entries = NULL;
+    if (error == CSFM_ERROR_SUCCESS) {
+        entries = malloc(sizeof(CSFM_IndexMergeEntry) * (entryCount + 1));
+        error = entries == NULL ? CSFM_ERROR_OUT_OF_MEMORY : CSFM_ERROR_SUCCESS;
+    }
+    if (error != CSFM_ERROR_SUCCESS) {
+        for (uint32_t b = 0; b < bookCount; b++) {
+            CSFM_IndexBookBuild_deallocate(&builds[b]);
+        }
+        free(builds);
+        return error;
+    }
+
+    uint32_t e = 0;
+    for (uint32_t b = 0; b < bookCount; b++) {
+        for (uint32_t t = 0; t < builds[b].term_count; t++) {
+            CSFM_IndexMergeEntry entry = {
+                .ptr = &builds[b].strings[builds[b].terms[t].string_offset],
+                .length = builds[b].terms[t].string_length,
+                .book = b,
+                .term = t,
+            };
+            entries[e++] = entry;
+        }
+    }
+    qsort(entries, entryCount, sizeof(CSFM_IndexMergeEntry), CSFM_IndexMergeEntry_compare);
+
+    uint32_t termCount = 0;
+    uint32_t stringsLength = namesLength;
+    uint32_t postingsLength = 0;
+    for (e = 0; e < entryCount; e++) {
+        const CSFM_IndexMergeEntry *entry = &entries[e];
+        if (e == 0 || entry->length != entries[e - 1].length || memcmp(entry->ptr, entries[e - 1].ptr, entry->length) != 0) {
+            termCount++;
+            stringsLength += entry->length;
+        }
+        postingsLength += builds[entry->book].terms[entry->term].block_length;
+    }
+
+    uint64_t size = sizeof(CSFM_IndexHeader) + (uint64_t)sizeof(CSFM_IndexBook) * bookCount +
+        (uint64_t)sizeof(CSFM_IndexTerm) * termCount + stringsLength + postingsLength;
+    uint8_t *buffer = size <= UINT32_MAX ? malloc(size) : NULL;
+    if (buffer == NULL) {
+        error = CSFM_ERROR_OUT_OF_MEMORY;
+    } else {
+        CSFM_IndexHeader *header = (CSFM_IndexHeader *)buffer;
+        CSFM_IndexBook *bookTable = (CSFM_IndexBook *)(header + 1);
+        CSFM_IndexTerm *termTable = (CSFM_IndexTerm *)(bookTable + bookCount);
+        uint8_t *strings = (uint8_t *)(termTable + termCount);
+        uint8_t *postings = strings + stringsLength;
+        header->magic = CSFM_INDEX_MAGIC;
+        header->version = CSFM_INDEX_VERSION;
+        header->book_count = bookCount;
+        header->term_count = termCount;
+        header->strings_offset = (uint32_t)(strings - buffer);
+        header->strings_length = stringsLength;
+        header->postings_offset = (uint32_t)(postings - buffer);
+        header->postings_length = postingsLength;
+
+        uint32_t stringOffset = 0;
+        for (uint32_t b = 0; b < bookCount; b++) {
+            bookTable[b].name_offset = stringOffset;
+            bookTable[b].name_length = builds[b].name.length;
+            // NOTE(mattg): A book without \id has no name, and a NULL pointer.
+            if (builds[b].name.length > 0) {
+                memcpy(&strings[stringOffset], builds[b].name.ptr, builds[b].name.length);
+                stringOffset += builds[b].name.length;
+            }
+        }
+        uint32_t postingOffset = 0;
+        CSFM_IndexTerm *term = termTable - 1;
+        for (e = 0; e < entryCount; e++) {
+            const CSFM_IndexMergeEntry *entry = &entries[e];
+            if (e == 0 || entry->length != entries[e - 1].length || memcmp(entry->ptr, entries[e - 1].ptr, entry->length) != 0) {
+                term++;
+                term->string_offset = stringOffset;
+                term->string_length = entry->length;
+                term->postings_offset = postingOffset;
+                term->postings_length = 0;
+                term->count = 0;
+                memcpy(&strings[stringOffset], entry->ptr, entry->length);
+                stringOffset += entry->length;
+            }
+            const CSFM_IndexBookBuild *build = &builds[entry->book];
+            const CSFM_IndexLocalTerm *local = &build->terms[entry->term];
+            memcpy(&postings[postingOffset], &build->blocks[local->block_offset], local->block_length);
+            postingOffset += local->block_length;
+            term->postings_length += local->block_length;
+            term->count += local->count;
+        }
+        out->ptr = buffer;
+        out->length = (uint32_t)size;
+    }
+
+    free(entries);
+    for (uint32_t b = 0; b < bookCount; b++) {
+        CSFM_IndexBookBuild_deallocate(&builds[b]);
+    }
+    free(builds);
+    return error;
+}
+
+bool CSFM_IndexView_init(CSFM_IndexView *view, const uint8_t *bytes, uint32_t size) {
+    if (view == NULL || bytes == NULL || size < sizeof(CSFM_IndexHeader) || ((uintptr_t)bytes & 3) != 0) {
+        return false;
+    }
+    // NOTE(mattg): The magic also reads wrong on a big endian host.
+    const CSFM_IndexHeader *header = (const CSFM_IndexHeader *)bytes;
+    if (header->magic != CSFM_INDEX_MAGIC || header->version != CSFM_INDEX_VERSION) {
+        return false;
+    }
+    uint64_t tables = sizeof(CSFM_IndexHeader) + (uint64_t)sizeof(CSFM_IndexBook) * header->book_count +
+        (uint64_t)sizeof(CSFM_IndexTerm) * header->term_count;
+    if (tables > header->strings_offset ||
+        (uint64_t)header->strings_offset + header->strings_length > header->postings_offset ||
+        (uint64_t)header->postings_offset + header->postings_length > size) {
+        return false;
+    }
+    view->header = header;
+    view->books = (const CSFM_IndexBook *)(header + 1);
+    view->terms = (const CSFM_IndexTerm *)(view->books + header->book_count);
+    view->strings = bytes + header->strings_offset;
+    view->postings = bytes + header->postings_offset;
+    return true;
+}
+
+CSFM_String8Slice CSFM_IndexView_bookName(const CSFM_IndexView *view, uint32_t book) {
+    CSFM_String8Slice name = {0};
+    if (view == NULL || book >= view->header->book_count) {
+        return name;
+    }
+    const CSFM_IndexBook *entry = &view->books[book];
+    if ((uint64_t)entry->name_offset + entry->name_length <= view->header->strings_length) {
+        name.ptr = (uint8_t *)&view->strings[entry->name_offset];
+        name.length = entry->name_length;
+    }
+    return name;
+}
+
+uint32_t CSFM_IndexView_find(const CSFM_IndexView *view, const uint8_t *term, uint32_t length) {
+    if (view == NULL) {
+        return UINT32_MAX;
+    }
+    uint32_t low = 0;
+    uint32_t high = view->header->term_count;
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        const CSFM_IndexTerm *candidate = &view->terms[mid];
+        if ((uint64_t)candidate->string_offset + candidate->string_length > view->header->strings_length) {
+            return UINT32_MAX;
+        }
+        uint32_t common = candidate->string_length < length ? candidate->string_length : length;
+        int order = memcmp(&view->strings[candidate->string_offset], term, common);
+        if (order == 0 && candidate->string_length != length) {
+            order = candidate->string_length < length ? -1 : 1;
+        }
+        if (order == 0) {
+            return mid;
+        }
+        if (order < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return UINT32_MAX;
+}
+
+// Decodes the postings of one term in order.
+typedef struct {
+    const uint8_t *ptr;
+    const uint8_t *end;
+    const uint8_t *block_end;
+    uint32_t remaining;
+    CSFM_IndexPosting current;
+    bool done;
+} CSFM_IndexCursor;
+
+static void CSFM_IndexCursor_advance(CSFM_IndexCursor *cursor) {
+    while (cursor->remaining == 0) {
+        uint32_t book = 0;
+        uint32_t length = 0;
+        cursor->ptr = cursor->block_end;
+        if (!CSFM_readVarint(&cursor->ptr, cursor->end, &book) ||
+            !CSFM_readVarint(&cursor->ptr, cursor->end, &cursor->remaining) ||
+            !CSFM_readVarint(&cursor->ptr, cursor->end, &length) ||
+            length > (uint32_t)(cursor->end - cursor->ptr)) {
+            cursor->done = true;
+            return;
+        }
+        cursor->block_end = cursor->ptr + length;
+        cursor->current.book = book;
+        cursor->current.chapter = 0;
+        cursor->current.verse = 0;
+        cursor->current.offset = 0;
+    }
+
+    CSFM_IndexPosting *current = &cursor->current;
+    uint32_t chapter = 0;
+    uint32_t verse = 0;
+    uint32_t offset = 0;
+    if (!CSFM_readVarint(&cursor->ptr, cursor->block_end, &chapter) ||
+        !CSFM_readVarint(&cursor->ptr, cursor->block_end, &verse) ||
+        !CSFM_readVarint(&cursor->ptr, cursor->block_end, &offset)) {
+        cursor->done = true;
+        return;
+    }
+    if (chapter != 0) {
+        current->chapter += chapter;
+        current->verse = verse;
+        current->offset = offset;
+    } else if (verse != 0) {
+        current->verse += verse;
+        current->offset = offset;
+    } else {
+        current->offset += offset;
+    }
+    cursor->remaining--;
+}
+
+static void CSFM_IndexCursor_init(CSFM_IndexCursor *cursor, const CSFM_IndexView *view, const CSFM_IndexTerm *term) {
+    memset(cursor, 0, sizeof(CSFM_IndexCursor));
+    if ((uint64_t)term->postings_offset + term->postings_length > view->header->postings_length) {
+        cursor->done = true;
+        return;
+    }
+    cursor->ptr = &view->postings[term->postings_offset];
+    cursor->end = cursor->ptr + term->postings_length;
+    cursor->block_end = cursor->ptr;
+    CSFM_IndexCursor_advance(cursor);
+}
+
+// Moves to the first posting at or after `target`, skipping whole books
+// without decoding them.
+static void CSFM_IndexCursor_seek(CSFM_IndexCursor *cursor, const CSFM_IndexPosting *target) {
+    while (!cursor->done && CSFM_IndexPosting_compare(&cursor->current, target) < 0) {
+        if (cursor->current.book < target->book) {
+            cursor->remaining = 0;
+        }
+        CSFM_IndexCursor_advance(cursor);
+    }
+}
+
+uint32_t CSFM_IndexView_phrase(
+    const CSFM_IndexView *view, const uint8_t *query, uint32_t length, CSFM_IndexPosting *out, uint32_t capacity
+) {
+    if (view == NULL || query == NULL) {
+        return 0;
+    }
+    if (length > CSFM_INDEX_MAX_QUERY) {
+        return 0;
+    }
+    CSFM_IndexCursor cursors[CSFM_INDEX_MAX_PHRASE];
+    // NOTE(mattg): Folding keeps the length, so the folded words never need
+    // more room than the query itself.
+    uint8_t folded[CSFM_INDEX_MAX_QUERY];
+    uint32_t foldedLength = 0;
+    uint32_t count = 0;
+    uint32_t index = 0;
+    for (;;) {
+        uint32_t wordLength = CSFM_nextWord(query, length, &index, &folded[foldedLength]);
+        if (wordLength == 0) {
+            break;
+        }
+        if (count == CSFM_INDEX_MAX_PHRASE) {
+            return 0;
+        }
+        uint32_t term = CSFM_IndexView_find(view, &folded[foldedLength], wordLength);
+        if (term == UINT32_MAX) {
+            return 0;
+        }
+        foldedLength += wordLength;
+        CSFM_IndexCursor_init(&cursors[count++], view, &view->terms[term]);
+    }
+    if (count == 0) {
+        return 0;
+    }
+
+    uint32_t matches = 0;
+    while (!cursors[0].done) {
+        CSFM_IndexPosting first = cursors[0].current;
+        bool matched = true;
+        for (uint32_t k = 1; k < count; k++) {
+            CSFM_IndexPosting want = first;
+            want.offset += k;
+            CSFM_IndexCursor_seek(&cursors[k], &want);
+            if (cursors[k].done) {
+                return matches;
+            }
+            if (CSFM_IndexPosting_compare(&cursors[k].current, &want) != 0) {
+                // NOTE(mattg): This is past `first`, the next candidate
+                // can't come before it.
+                CSFM_IndexPosting next = cursors[k].current;
+                next.offset = next.offset >= k ? next.offset - k : 0;
+                CSFM_IndexCursor_seek(&cursors[0], &next);
+                matched = false;
+                break;
+            }
+        }
+        if (matched) {
+            if (matches < capacity && out != NULL) {
+                out[matches] = first;
+            }
+            matches++;
+            CSFM_IndexCursor_advance(&cursors[0]);
+        }
+    }
+    return matches;
+}
+
+void CSFM_DiffChangeArray_deallocate(CSFM_DiffChangeArray *array) {
+    if (array == NULL) {
+        return;
+    }
+    free(array->buffer);
+    array->buffer = NULL;
+    array->length = 0;
+    array->capacity = 0;
+}
+
+CSFM_DiffChange CSFM_DiffChangeArray_get(CSFM_DiffChangeArray array, uint32_t index) {
+    if (index >= array.length) {
+        CSFM_DiffChange stub = {0};
+        return stub;
+    }
+    return array.buffer[index];
+}
+
+const char *CSFM_DiffKind_name(CSFM_DiffKind kind) {
+    switch (kind) {
+    case CSFM_DIFF_VERSE_ADDED:
+        return "verse added";
+    case CSFM_DIFF_VERSE_REMOVED:
+        return "verse removed";
+    case CSFM_DIFF_TEXT:
+        return "text";
+    case CSFM_DIFF_MARKER:
+        return "marker";
+    case CSFM_DIFF_VERSE_REWRITTEN:
+        return "verse rewritten";
+    default:
+        return "unknown";
+    }
+}
+
+void CSFM_DiffResult_deallocate(CSFM_DiffResult *result) {
+    if (result == NULL) {
+        return;
+    }
+    CSFM_DiffChangeArray_deallocate(&result->changes);
+}
+
+// Give up on lining up a verse past this many edits, the trace grows with
+// the square of it.
+#define CSFM_DIFF_MAX_EDITS 1024
+
+// A word, or a whole marker or attribute list.
+typedef struct {
+    uint32_t start;
+    uint32_t end;
+    bool marker;
+} CSFM_DiffUnit;
+
+typedef struct {
+    uint32_t chapter;
+    uint32_t number;
+    CSFM_String8Slice verse;
+    CSFM_NodeRange nodes;
+    uint32_t order;
+    uint64_t hash;
+} CSFM_DiffVerse;
+
+// Walks the units of a node range.
+typedef struct {
+    const CSFM_ParseResult *result;
+    uint32_t node;
+    uint32_t end;
+    // Next byte to look at inside a TEXT node, 0 when between nodes.
+    uint32_t position;
+} CSFM_DiffCursor;
+
+static bool CSFM_DiffCursor_next(CSFM_DiffCursor *cursor, CSFM_DiffUnit *unit) {
+    const uint8_t *ptr = cursor->result->input.ptr;
+    while (cursor->node < cursor->end) {
+        const CSFM_Node *node = CSFM_NodeArray_at(&cursor->result->tree, cursor->node);
+        if (node->type == CSFM_NODE_MARKER || node->type == CSFM_NODE_ATTRIBUTES) {
+            uint32_t end = node->end;
+            while (end > node->start && (CSFM_isTextSpace(ptr[end - 1]) || ptr[end - 1] == '\r' || ptr[end - 1] == '\n')) {
+                end--;
+            }
+            unit->start = node->start;
+            unit->end = end;
+            unit->marker = true;
+            cursor->node++;
+            return true;
+        }
+        if (node->type == CSFM_NODE_TEXT) {
+            uint32_t i = cursor->position > node->start ? cursor->position : node->start;
+            while (i < node->end && CSFM_isTextSpace(ptr[i])) {
+                i++;
+            }
+            if (i < node->end) {
+                uint32_t start = i;
+                while (i < node->end && !CSFM_isTextSpace(ptr[i])) {
+                    i++;
+                }
+                unit->start = start;
+                unit->end = i;
+                unit->marker = false;
+                cursor->position = i;
+                return true;
+            }
+        }
+        cursor->node++;
+        cursor->position = 0;
+    }
+    return false;
+}
+
+static uint64_t CSFM_DiffVerse_hash(const CSFM_ParseResult *result, CSFM_NodeRange nodes) {
+    // FNV-1a, 64 bit so a changed verse practically never hashes the same
+    uint64_t hash = 14695981039346656037u;
+    CSFM_DiffCursor cursor = {
+        .result = result,
+        .node = nodes.first,
+        .end = nodes.end,
+    };
+    CSFM_DiffUnit unit;
+    while (CSFM_DiffCursor_next(&cursor, &unit)) {
+        hash = (hash ^ (unit.marker ? 1u : 2u)) * 1099511628211u;
+        for (uint32_t i = unit.start; i < unit.end; i++) {
+            hash = (hash ^ result->input.ptr[i]) * 1099511628211u;
+        }
+    }
+    return hash;
+}
+
+static int CSFM_DiffVerse_compare(const void *a, const void *b) {
+    const CSFM_DiffVerse *left = a;
+    const CSFM_DiffVerse *right = b;
+    if (left->chapter != right->chapter) {
+        return left->chapter < right->chapter ? -1 : 1;
+    }
+    if (left->number != right->number) {
+        return left->number < right->number ? -1 : 1;
+    }
+    uint32_t length = left->verse.length < right->verse.length ? left->verse.length : right->verse.length;
+    int order = memcmp(left->verse.ptr, right->verse.ptr, length);
+    if (order != 0) {
+        return order;
+    }
+    if (left->verse.length != right->verse.length) {
+        return left->verse.length < right->verse.length ? -1 : 1;
+    }
+    if (left->order != right->order) {
+        return left->order < right->order ? -1 : 1;
+    }
+    return 0;
+}
+
+// Same reference, ignoring where in the document it was.
+static bool CSFM_DiffVerse_sameReference(const CSFM_DiffVerse *left, const CSFM_DiffVerse *right) {
+    return left->chapter == right->chapter && left->verse.length == right->verse.length &&
+        memcmp(left->verse.ptr, right->verse.ptr, left->verse.length) == 0;
+}
+
+typedef struct {
+    CSFM_DiffVerse *verses[2];
+    uint32_t verse_count[2];
+    uint32_t verse_capacity[2];
+    CSFM_DiffUnit *units[2];
+    uint32_t unit_capacity[2];
+    int32_t *v;
+    uint32_t v_capacity;
+    int32_t *trace;
+    uint32_t trace_capacity;
+    // forward edit script, see CSFM_DiffScratch_myers
+    uint8_t *script;
+    uint32_t script_capacity;
+} CSFM_DiffScratch;
+
+static void CSFM_DiffScratch_deallocate(CSFM_DiffScratch *scratch) {
+    for (uint32_t side = 0; side < 2; side++) {
+        free(scratch->verses[side]);
+        free(scratch->units[side]);
+    }
+    free(scratch->v);
+    free(scratch->trace);
+    free(scratch->script);
+}
+
+// Splits a document into verses at every `\c` and `\v` and sorts them by
+// reference.
+static CSFM_ErrorType CSFM_DiffScratch_collect(CSFM_DiffScratch *scratch, uint32_t side, const CSFM_ParseResult *result) {
+    scratch->verse_count[side] = 0;
+    uint32_t chapter = 0;
+    uint32_t first = 0;
+    CSFM_String8Slice verse = {
+        .ptr = result->input.ptr,
+        .length = 0,
+    };
+    for (uint32_t i = 0; i <= result->tree.length; i++) {
+        const CSFM_Node *node = i < result->tree.length ? CSFM_NodeArray_at(&result->tree, i) : NULL;
+        if (node != NULL) {
+            if (node->type != CSFM_NODE_MARKER || CSFM_Node_isClose(node)) {
+                continue;
+            }
+            CSFM_MarkerKind kind = CSFM_Marker_kind(node->marker);
+            if (kind != CSFM_MARKER_KIND_CHAPTER && kind != CSFM_MARKER_KIND_VERSE) {
+                continue;
+            }
+        }
+
+        if (i > first) {
+            CSFM_ErrorType error = CSFM_reserve(
+                (void **)&scratch->verses[side], &scratch->verse_capacity[side], scratch->verse_count[side] + 1, sizeof(CSFM_DiffVerse)
+            );
+            if (error != CSFM_ERROR_SUCCESS) {
+                return error;
+            }
+            CSFM_DiffVerse entry = {
+                .chapter = chapter,
+                .verse = verse,
+                .nodes = {
+                    .first = first,
+                    .end = i,
+                },
+                .order = scratch->verse_count[side],
+            };
+            for (uint32_t d = 0; d < verse.length && verse.ptr[d] >= '0' && verse.ptr[d] <= '9'; d++) {
+                entry.number = entry.number * 10 + (uint32_t)(verse.ptr[d] - '0');
+            }
+            entry.hash = CSFM_DiffVerse_hash(result, entry.nodes);
+            scratch->verses[side][scratch->verse_count[side]++] = entry;
+        }
+        if (node == NULL) {
+            break;
+        }
+
+        first = i;
+        uint32_t text = CSFM_nextTextNode(result, i);
+        uint32_t rest = 0;
+        CSFM_String8Slice word = {
+            .ptr = &result->input.ptr[node->end],
+            .length = 0,
+        };
+        if (text != UINT32_MAX) {
+            word = CSFM_firstWord(result->input, CSFM_NodeArray_at(&result->tree, text), &rest);
+        }
+        if (CSFM_Marker_kind(node->marker) == CSFM_MARKER_KIND_CHAPTER) {
+            chapter = 0;
+            for (uint32_t d = 0; d < word.length && word.ptr[d] >= '0' && word.ptr[d] <= '9'; d++) {
+                chapter = chapter * 10 + (uint32_t)(word.ptr[d] - '0');
+            }
+            verse.ptr = word.ptr;
+            verse.length = 0;
+        } else {
+            verse = word;
+        }
+    }
+    qsort(scratch->verses[side], scratch->verse_count[side], sizeof(CSFM_DiffVerse), CSFM_DiffVerse_compare);
+    return CSFM_ERROR_SUCCESS;
+}
+
+static CSFM_ErrorType CSFM_DiffScratch_units(
+    CSFM_DiffScratch *scratch, uint32_t side, const CSFM_ParseResult *result, CSFM_NodeRange nodes, uint32_t *count
+) {
+    *count = 0;
+    CSFM_DiffCursor cursor = {
+        .result = result,
+        .node = nodes.first,
+        .end = nodes.end,
+    };
+    CSFM_DiffUnit unit;
+    while (CSFM_DiffCursor_next(&cursor, &unit)) {
+        CSFM_ErrorType error = CSFM_reserve((void **)&scratch->units[side], &scratch->unit_capacity[side], *count + 1, sizeof(CSFM_DiffUnit));
+        if (error != CSFM_ERROR_SUCCESS) {
+            return error;
+        }
+        scratch->units[side][(*count)++] = unit;
+    }
+    return CSFM_ERROR_SUCCESS;
+}
+
+static inline bool CSFM_DiffUnit_equal(
+    const CSFM_ParseResult *oldResult, const CSFM_DiffUnit *a, const CSFM_ParseResult *newResult, const CSFM_DiffUnit *b
+) {
+    uint32_t length = a->end - a->start;
+    return a->marker == b->marker && length == b->end - b->start &&
+        memcmp(&oldResult->input.ptr[a->start], &newResult->input.ptr[b->start], length) == 0;
+}
+
+#define CSFM_DIFF_EQUAL 0
+#define CSFM_DIFF_DELETE 1
+#define CSFM_DIFF_INSERT 2
+
+// Myers' O(ND) diff of the two unit arrays. Fills `script` with one
+// CSFM_DIFF_* op per step in forward order and returns its length, or
+// UINT32_MAX when it takes more than CSFM_DIFF_MAX_EDITS edits.
+static uint32_t CSFM_DiffScratch_myers(
+    CSFM_DiffScratch *scratch, const CSFM_ParseResult *oldResult, uint32_t n, const CSFM_ParseResult *newResult, uint32_t m,
+    CSFM_ErrorType *error
+) {
+    const CSFM_DiffUnit *a = scratch->units[0];
+    const CSFM_DiffUnit *b = scratch->units[1];
+    int32_t max = (int32_t)(n + m);
+    int32_t limit = max < CSFM_DIFF_MAX_EDITS ? max : CSFM_DIFF_MAX_EDITS;
+    *error = CSFM_reserve((void **)&scratch->v, &scratch->v_capacity, (uint32_t)(2 * limit + 3), sizeof(int32_t));
+    if (*error == CSFM_ERROR_SUCCESS) {
+        *error = CSFM_reserve((void **)&scratch->script, &scratch->script_capacity, n + m + 1, 1);
+    }
+    if (*error != CSFM_ERROR_SUCCESS) {
+        return UINT32_MAX;
+    }
+    // NOTE(mattg): v is indexed by diagonal k + limit + 1 and the trace keeps
+    // v[-d .. d] after every step d at trace[d * d], d^2 entries in total.
+    int32_t *v = scratch->v + limit + 1;
+    v[1] = 0;
+    int32_t d = 0;
+    bool found = false;
+    for (; d <= limit && !found; d++) {
+        for (int32_t k = -d; k <= d; k += 2) {
+            int32_t x = (k == -d || (k != d && v[k - 1] < v[k + 1])) ? v[k + 1] : v[k - 1] + 1;
+            int32_t y = x - k;
+            while (x < (int32_t)n && y < (int32_t)m && CSFM_DiffUnit_equal(oldResult, &a[x], newResult, &b[y])) {
+                x++;
+                y++;
+            }
+            v[k] = x;
+            if (x >= (int32_t)n && y >= (int32_t)m) {
+                found = true;
+            }
+        }
+        uint32_t base = (uint32_t)(d * d);
+        *error = CSFM_reserve((void **)&scratch->trace, &scratch->trace_capacity, base + (uint32_t)(2 * d + 1), sizeof(int32_t));
+        if (*error != CSFM_ERROR_SUCCESS) {
+            return UINT32_MAX;
+        }
+        memcpy(&scratch->trace[base], &v[-d], sizeof(int32_t) * (size_t)(2 * d + 1));
+    }
+    if (!found) {
+        return UINT32_MAX;
+    }
+
+    // Walk back from the end through the trace, writing the script backwards.
+    d--;
+    uint32_t length = 0;
+    int32_t x = (int32_t)n;
+    int32_t y = (int32_t)m;
+    for (; d > 0; d--) {
+        const int32_t *previous = &scratch->trace[(d - 1) * (d - 1)] + (d - 1);
+        int32_t k = x - y;
+        bool down = k == -d || (k != d && previous[k - 1] < previous[k + 1]);
+        int32_t previousK = down ? k + 1 : k - 1;
+        int32_t previousX = previous[previousK];
+        int32_t previousY = previousX - previousK;
+        while (x > previousX && y > previousY) {
+            scratch->script[length++] = CSFM_DIFF_EQUAL;
+            x--;
+            y--;
+        }
+        scratch->script[length++] = down ? CSFM_DIFF_INSERT : CSFM_DIFF_DELETE;
+        x = previousX;
+        y = previousY;
+    }
+    while (x > 0 && y > 0) {
+        scratch->script[length++] = CSFM_DIFF_EQUAL;
+        x--;
+        y--;
+    }
+    for (uint32_t i = 0; i < length / 2; i++) {
+        uint8_t swap = scratch->script[i];
+        scratch->script[i] = scratch->script[length - 1 - i];
+        scratch->script[length - 1 - i] = swap;
+    }
+    return length;
+}
+
+static CSFM_ErrorType CSFM_DiffResult_push(CSFM_DiffResult *result, CSFM_DiffChange change) {
+    CSFM_DiffChangeArray *array = &result->changes;
+    CSFM_ErrorType error = CSFM_reserve((void **)&array->buffer, &array->capacity, array->length + 1, sizeof(CSFM_DiffChange));
+    if (error == CSFM_ERROR_SUCCESS) {
+        array->buffer[array->length++] = change;
+    }
+    return error;
+}
+
+static uint32_t CSFM_DiffVerse_byteStart(const CSFM_ParseResult *result, const CSFM_DiffVerse *verse) {
+    return verse->nodes.first < result->tree.length ? CSFM_NodeArray_at(&result->tree, verse->nodes.first)->start : result->input.length;
+}
+
+static uint32_t CSFM_DiffVerse_byteEnd(const CSFM_ParseResult *result, const CSFM_DiffVerse *verse) {
+    return verse->nodes.end > verse->nodes.first ? CSFM_NodeArray_at(&result->tree, verse->nodes.end - 1)->end : CSFM_DiffVerse_byteStart(result, verse);
+}
+
+// Diffs the units of one changed verse and reports runs of edits, split
+// wherever they switch between text and markers.
+static CSFM_ErrorType CSFM_DiffScratch_verse(
+    CSFM_DiffScratch *scratch, CSFM_DiffResult *result, const CSFM_ParseResult *oldResult, const CSFM_DiffVerse *oldVerse,
+    const CSFM_ParseResult *newResult, const CSFM_DiffVerse *newVerse
+) {
+    uint32_t n = 0;
+    uint32_t m = 0;
+    CSFM_ErrorType error = CSFM_DiffScratch_units(scratch, 0, oldResult, oldVerse->nodes, &n);
+    if (error == CSFM_ERROR_SUCCESS) {
+        error = CSFM_DiffScratch_units(scratch, 1, newResult, newVerse->nodes, &m);
+    }
+    if (error != CSFM_ERROR_SUCCESS) {
+        return error;
+    }
+    CSFM_DiffChange change = {
+        .chapter = newVerse->chapter,
+        .verse = newVerse->verse,
+    };
+    uint32_t length = CSFM_DiffScratch_myers(scratch, oldResult, n, newResult, m, &error);
+    if (error != CSFM_ERROR_SUCCESS) {
+        return error;
+    }
+    if (length == UINT32_MAX) {
+        change.kind = CSFM_DIFF_VERSE_REWRITTEN;
+        change.old_start = CSFM_DiffVerse_byteStart(oldResult, oldVerse);
+        change.old_end = CSFM_DiffVerse_byteEnd(oldResult, oldVerse);
+        change.new_start = CSFM_DiffVerse_byteStart(newResult, newVerse);
+        change.new_end = CSFM_DiffVerse_byteEnd(newResult, newVerse);
+        return CSFM_DiffResult_push(result, change);
+    }
+
+    const CSFM_DiffUnit *a = scratch->units[0];
+    const CSFM_DiffUnit *b = scratch->units[1];
+    uint32_t oldEnd = CSFM_DiffVerse_byteEnd(oldResult, oldVerse);
+    uint32_t newEnd = CSFM_DiffVerse_byteEnd(newResult, newVerse);
+    uint32_t i = 0;
+    uint32_t j = 0;
+    bool open = false;
+    for (uint32_t s = 0; s <= length && error == CSFM_ERROR_SUCCESS; s++) {
+        uint8_t op = s < length ? scratch->script[s] : CSFM_DIFF_EQUAL;
+        bool marker = op == CSFM_DIFF_DELETE ? a[i].marker : (op == CSFM_DIFF_INSERT ? b[j].marker : false);
+        CSFM_DiffKind kind = marker ? CSFM_DIFF_MARKER : CSFM_DIFF_TEXT;
+        if (open && (op == CSFM_DIFF_EQUAL || kind != change.kind)) {
+            error = CSFM_DiffResult_push(result, change);
+            open = false;
+        }
+        if (op == CSFM_DIFF_EQUAL) {
+            i++;
+            j++;
+            continue;
+        }
+        if (!open) {
+            open = true;
+            change.kind = kind;
+            change.old_start = change.old_end = i < n ? a[i].start : oldEnd;
+            change.new_start = change.new_end = j < m ? b[j].start : newEnd;
+        }
+        if (op == CSFM_DIFF_DELETE) {
+            change.old_end = a[i].end;
+            i++;
+        } else {
+            change.new_end = b[j].end;
+            j++;
+        }
+    }
+    return error;
+}
+
+static void CSFM_DiffScratch_run(
+    CSFM_DiffScratch *scratch, const CSFM_ParseResult *oldResult, const CSFM_ParseResult *newResult, CSFM_DiffResult *result
+) {
+    memset(result, 0, sizeof(CSFM_DiffResult));
+    result->error = CSFM_DiffScratch_collect(scratch, 0, oldResult);
+    if (result->error == CSFM_ERROR_SUCCESS) {
+        result->error = CSFM_DiffScratch_collect(scratch, 1, newResult);
+    }
+
+    // Merge join over the verses sorted by reference.
+    uint32_t i = 0;
+    uint32_t j = 0;
+    const CSFM_DiffVerse *oldVerses = scratch->verses[0];
+    const CSFM_DiffVerse *newVerses = scratch->verses[1];
+    while (result->error == CSFM_ERROR_SUCCESS && (i < scratch->verse_count[0] || j < scratch->verse_count[1])) {
+        int order = 0;
+        if (i >= scratch->verse_count[0]) {
+            order = 1;
+        } else if (j >= scratch->verse_count[1]) {
+            order = -1;
+        } else if (!CSFM_DiffVerse_sameReference(&oldVerses[i], &newVerses[j])) {
+            order = CSFM_DiffVerse_compare(&oldVerses[i], &newVerses[j]);
+        }
+
+        if (order == 0) {
+            result->verses++;
+            if (oldVerses[i].hash != newVerses[j].hash) {
+                result->changed_verses++;
+                result->error = CSFM_DiffScratch_verse(scratch, result, oldResult, &oldVerses[i], newResult, &newVerses[j]);
+            }
+            i++;
+            j++;
+            continue;
+        }
+        const CSFM_DiffVerse *verse = order < 0 ? &oldVerses[i] : &newVerses[j];
+        CSFM_DiffChange change = {
+            .kind = order < 0 ? CSFM_DIFF_VERSE_REMOVED : CSFM_DIFF_VERSE_ADDED,
+            .chapter = verse->chapter,
+            .verse = verse->verse,
+        };
+        if (order < 0) {
+            change.old_start = CSFM_DiffVerse_byteStart(oldResult, verse);
+            change.old_end = CSFM_DiffVerse_byteEnd(oldResult, verse);
+            i++;
+        } else {
+            change.new_start = CSFM_DiffVerse_byteStart(newResult, verse);
+            change.new_end = CSFM_DiffVerse_byteEnd(newResult, verse);
+            j++;
+        }
+        result->error = CSFM_DiffResult_push(result, change);
+    }
+}
+
+CSFM_DiffResult CSFM_Diff(const CSFM_ParseResult *oldResult, const CSFM_ParseResult *newResult) {
+    CSFM_DiffResult result = {0};
+    if (oldResult == NULL || newResult == NULL) {
+        return result;
+    }
+    CSFM_DiffScratch scratch = {0};
+    CSFM_DiffScratch_run(&scratch, oldResult, newResult, &result);
+    CSFM_DiffScratch_deallocate(&scratch);
+    return result;
+}
+
+typedef struct {
+    const CSFM_ParseResult *old_results;
+    const CSFM_ParseResult *new_results;
+    CSFM_DiffResult *results;
+    uint32_t count;
+    uint32_t next;
+} CSFM_DiffWork;
+
+static void *CSFM_DiffWork_run(void *user) {
+    CSFM_DiffWork *work = user;
+    CSFM_DiffScratch scratch = {0};
+    for (;;) {
+        uint32_t pair = __atomic_fetch_add(&work->next, 1, __ATOMIC_RELAXED);
+        if (pair >= work->count) {
+            break;
+        }
+        CSFM_TRACE_BEGIN(diff);
+        CSFM_DiffScratch_run(&scratch, &work->old_results[pair], &work->new_results[pair], &work->results[pair]);
+        CSFM_TRACE_END(diff, NULL, (uint64_t)work->old_results[pair].input.length + work->new_results[pair].input.length);
+    }
+    CSFM_DiffScratch_deallocate(&scratch);
+    return NULL;
+}
+
+void CSFM_DiffMany(
+    const CSFM_ParseResult *oldResults, const CSFM_ParseResult *newResults, uint32_t count, uint32_t threads,
+    CSFM_DiffResult *results
+) {
+    if (oldResults == NULL || newResults == NULL || results == NULL) {
+        return;
+    }
+    CSFM_DiffWork work = {
+        .old_results = oldResults,
+        .new_results = newResults,
+        .results = results,
+        .count = count,
+    };
+    CSFM_runWorkers(threads, count, CSFM_DiffWork_run, &work);
+}
+
+#if defined(CSFM_THREADS)
+// Bounded single producer, single consumer queue. `tail` is only written by
+// the producer and `head` only by the consumer, each on its own cache line.
+typedef struct {
+    void *slots[CSFM_PIPELINE_DEPTH];
+    uint8_t pad0[64];
+    uint32_t head;
+    uint8_t pad1[64 - sizeof(uint32_t)];
+    uint32_t tail;
+    uint8_t pad2[64 - sizeof(uint32_t)];
+} CSFM_Ring;
+
+static bool CSFM_Ring_tryPush(CSFM_Ring *ring, void *item) {
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    if (tail - head == CSFM_PIPELINE_DEPTH) {
+        return false;
+    }
+    ring->slots[tail & (CSFM_PIPELINE_DEPTH - 1)] = item;
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+static bool CSFM_Ring_tryPop(CSFM_Ring *ring, void **item) {
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (head == tail) {
+        return false;
+    }
+    *item = ring->slots[head & (CSFM_PIPELINE_DEPTH - 1)];
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+// NOTE(mattg): Spin briefly, then give the core away, a stage that waits
+// is by definition not the bottleneck.
+#define CSFM_RING_SPINS 64
+
+static void CSFM_Ring_push(CSFM_Ring *ring, void *item, uint64_t *waited) {
+    if (CSFM_Ring_tryPush(ring, item)) {
+        return;
+    }
+    uint64_t start = CSFM_nanoseconds();
+    for (uint32_t spins = 0; !CSFM_Ring_tryPush(ring, item); spins++) {
+        if (spins >= CSFM_RING_SPINS) {
+            sched_yield();
+        }
+    }
+    *waited += CSFM_nanoseconds() - start;
+}
+
+static void *CSFM_Ring_pop(CSFM_Ring *ring, uint64_t *waited) {
+    void *item = NULL;
+    if (CSFM_Ring_tryPop(ring, &item)) {
+        return item;
+    }
+    uint64_t start = CSFM_nanoseconds();
+    for (uint32_t spins = 0; !CSFM_Ring_tryPop(ring, &item); spins++) {
+        if (spins >= CSFM_RING_SPINS) {
+            sched_yield();
+        }
+    }
+    *waited += CSFM_nanoseconds() - start;
+    return item;
+}
+
+typedef struct {
+    uint8_t data[CSFM_PIPELINE_BLOCK_SIZE];
+    uint32_t length;
+    bool last;
+    bool failed;
+} CSFM_PipelineBlock;
+
+// Whole lines of the document and their tokens, offsets are into the
+// document. The parser reads them in place.
+typedef struct {
+    uint8_t *document;
+    uint32_t start;
+    uint32_t length;
+    CSFM_Token *tokens;
+    uint32_t token_count;
+    uint32_t token_capacity;
+    bool last;
+    CSFM_ErrorType error;
+} CSFM_PipelineBatch;
+
+typedef struct {
+    FILE *file;
+    CSFM_Ring full_blocks;
+    CSFM_Ring free_blocks;
+    CSFM_Ring full_batches;
+    CSFM_Ring free_batches;
+    CSFM_PipelineBlock *blocks;
+    CSFM_PipelineBatch batches[CSFM_PIPELINE_DEPTH];
+    // Everything read so far, appended to by the tokenizer. Ends up as the
+    // result's input.
+    uint8_t *document;
+    uint32_t document_length;
+    uint32_t document_capacity;
+    CSFM_PipelineStats stats;
+} CSFM_Pipeline;
+
+static void *CSFM_Pipeline_read(void *user) {
+    CSFM_Pipeline *pipeline = user;
+    CSFM_TRACE_THREAD("csfm reader");
+    uint64_t start = CSFM_nanoseconds();
+    uint64_t waited = 0;
+    bool last = false;
+    while (!last) {
+        CSFM_PipelineBlock *block = CSFM_Ring_pop(&pipeline->free_blocks, &waited);
+        CSFM_TRACE_BEGIN(read);
+        block->length = (uint32_t)fread(block->data, 1, CSFM_PIPELINE_BLOCK_SIZE, pipeline->file);
+        CSFM_TRACE_END(read, NULL, block->length);
+        // NOTE(mattg): fread only comes up short at the end or on an error.
+        block->last = last = block->length < CSFM_PIPELINE_BLOCK_SIZE;
+        block->failed = last && ferror(pipeline->file) != 0;
+        pipeline->stats.blocks++;
+        CSFM_Ring_push(&pipeline->full_blocks, block, &waited);
+    }
+    pipeline->stats.wait_ns[CSFM_STAGE_READER] = waited;
+    pipeline->stats.busy_ns[CSFM_STAGE_READER] = CSFM_nanoseconds() - start - waited;
+    return NULL;
+}
+
+static CSFM_ErrorType CSFM_PipelineBatch_tokenize(CSFM_PipelineBatch *batch, const uint8_t *bytes, uint32_t length, uint32_t base) {
+    CSFM_TRACE_BEGIN(tokenize);
+    batch->token_count = 0;
+    CSFM_ErrorType error = CSFM_reserve((void **)&batch->tokens, &batch->token_capacity, length, sizeof(CSFM_Token));
+    if (error != CSFM_ERROR_SUCCESS) {
+        return error;
+    }
+    CSFM_String8Slice input = {
+        .ptr = (uint8_t *)bytes,
+        .length = length,
+    };
+    uint32_t index = 0;
+    while (index < length) {
+        CSFM_Token token = consumeToken(input, &index);
+        token.start += base;
+        token.end += base;
+        batch->tokens[batch->token_count++] = token;
+    }
+    CSFM_TRACE_END(tokenize, NULL, length);
+    return CSFM_ERROR_SUCCESS;
+}
+
+// NOTE(mattg): The parser reads batches straight out of the document, so it
+// can only move once every batch is back in the free ring. A file that said
+// how big it is never gets here, a pipe only a few times as it doubles.
+static CSFM_ErrorType CSFM_Pipeline_grow(CSFM_Pipeline *pipeline, uint64_t needed, uint64_t *waited) {
+    if (needed > UINT32_MAX) {
+        return CSFM_ERROR_OUT_OF_MEMORY;
+    }
+    CSFM_PipelineBatch *batches[CSFM_PIPELINE_DEPTH];
+    for (uint32_t i = 0; i < CSFM_PIPELINE_DEPTH; i++) {
+        batches[i] = CSFM_Ring_pop(&pipeline->free_batches, waited);
+    }
+    CSFM_ErrorType error = CSFM_reserve((void **)&pipeline->document, &pipeline->document_capacity, (uint32_t)needed, 1);
+    for (uint32_t i = 0; i < CSFM_PIPELINE_DEPTH; i++) {
+        CSFM_Ring_push(&pipeline->free_batches, batches[i], waited);
+    }
+    return error;
+}
+
+static void *CSFM_Pipeline_tokenize(void *user) {
+    CSFM_Pipeline *pipeline = user;
+    CSFM_TRACE_THREAD("csfm tokenizer");
+    uint64_t start = CSFM_nanoseconds();
+    uint64_t waited = 0;
+    // Everything before `handed` is in a batch already, the rest is the tail
+    // of an unfinished line.
+    uint32_t handed = 0;
+    CSFM_ErrorType error = CSFM_ERROR_SUCCESS;
+    bool readerDone = false;
+    bool last = false;
+    while (!last) {
+        CSFM_PipelineBlock *block = CSFM_Ring_pop(&pipeline->full_blocks, &waited);
+        readerDone = block->last;
+        if (block->failed) {
+            error = CSFM_ERROR_IO;
+        }
+        uint32_t length = pipeline->document_length;
+        uint64_t needed = (uint64_t)length + block->length;
+        if (error == CSFM_ERROR_SUCCESS && needed > pipeline->document_capacity) {
+            error = CSFM_Pipeline_grow(pipeline, needed, &waited);
+        }
+        if (error == CSFM_ERROR_SUCCESS) {
+            memcpy(&pipeline->document[length], block->data, block->length);
+            length += block->length;
+            pipeline->document_length = length;
+        }
+        CSFM_Ring_push(&pipeline->free_blocks, block, &waited);
+        last = readerDone || error != CSFM_ERROR_SUCCESS;
+
+        uint32_t cut = length;
+        if (!last) {
+            while (cut > handed && pipeline->document[cut - 1] != '\n') {
+                cut--;
+            }
+            if (cut == handed) {
+                continue;
+            }
+        }
+
+        CSFM_PipelineBatch *batch = CSFM_Ring_pop(&pipeline->free_batches, &waited);
+        batch->last = last;
+        batch->error = error;
+        batch->document = pipeline->document;
+        batch->start = handed;
+        batch->length = cut - handed;
+        if (error == CSFM_ERROR_SUCCESS) {
+            batch->error = CSFM_PipelineBatch_tokenize(batch, &pipeline->document[handed], cut - handed, handed);
+        }
+        handed = cut;
+        if (batch->error != CSFM_ERROR_SUCCESS) {
+            batch->last = last = true;
+        }
+        pipeline->stats.batches++;
+        CSFM_Ring_push(&pipeline->full_batches, batch, &waited);
+    }
+
+    // NOTE(mattg): After an error the reader still has to be let finish.
+    while (!readerDone) {
+        CSFM_PipelineBlock *block = CSFM_Ring_pop(&pipeline->full_blocks, &waited);
+        readerDone = block->last;
+        CSFM_Ring_push(&pipeline->free_blocks, block, &waited);
+    }
+    pipeline->stats.wait_ns[CSFM_STAGE_TOKENIZER] = waited;
+    pipeline->stats.busy_ns[CSFM_STAGE_TOKENIZER] = CSFM_nanoseconds() - start - waited;
+    return NULL;
+}
+
+// The bytes left in `file` if it can tell, 0 otherwise (pipes, terminals).
+static uint32_t CSFM_Pipeline_sizeHint(FILE *file) {
+    long position = ftell(file);
+    if (position < 0 || fseek(file, 0, SEEK_END) != 0) {
+        return 0;
+    }
+    long end = ftell(file);
+    if (fseek(file, position, SEEK_SET) != 0 || end <= position || (uint64_t)(end - position) > UINT32_MAX) {
+        return 0;
+    }
+    return (uint32_t)(end - position);
+}
+
+CSFM_ParseResult CSFM_Pipeline_parse(FILE *file, CSFM_Options options, CSFM_PipelineStats *stats) {
+    CSFM_ParseResult result = {0};
+    uint64_t start = CSFM_nanoseconds();
+    CSFM_TRACE_BEGIN(parse);
+    // NOTE(mattg): With the size known up front the document is allocated
+    // once and never moves.
+    uint32_t capacity = file != NULL ? CSFM_Pipeline_sizeHint(file) : 0;
+    capacity = capacity > 0 ? capacity : CSFM_PIPELINE_BLOCK_SIZE;
+    CSFM_Pipeline *pipeline = calloc(1, sizeof(CSFM_Pipeline));
+    CSFM_PipelineBlock *blocks = calloc(CSFM_PIPELINE_DEPTH, sizeof(CSFM_PipelineBlock));
+    uint8_t *document = malloc(capacity);
+    if (file == NULL || pipeline == NULL || blocks == NULL || document == NULL) {
+        free(pipeline);
+        free(blocks);
+        free(document);
+        result.error = file == NULL ? CSFM_ERROR_IO : CSFM_ERROR_OUT_OF_MEMORY;
+        return result;
+    }
+    pipeline->file = file;
+    pipeline->blocks = blocks;
+    pipeline->document = document;
+    pipeline->document_capacity = capacity;
+    for (uint32_t i = 0; i < CSFM_PIPELINE_DEPTH; i++) {
+        CSFM_Ring_tryPush(&pipeline->free_blocks, &pipeline->blocks[i]);
+        CSFM_Ring_tryPush(&pipeline->free_batches, &pipeline->batches[i]);
+    }
+
+    pthread_t tokenizer;
+    pthread_t reader;
+    if (pthread_create(&tokenizer, NULL, CSFM_Pipeline_tokenize, pipeline) != 0) {
+        free(pipeline->document);
+        free(pipeline->blocks);
+        free(pipeline);
+        result.error = CSFM_ERROR_OUT_OF_MEMORY;
+        return result;
+    }
+    bool readerStarted = pthread_create(&reader, NULL, CSFM_Pipeline_read, pipeline) == 0;
+    if (!readerStarted) {
+        // NOTE(mattg): Stand in for the reader so the tokenizer ends cleanly.
+        // The block is taken out of the free ring, the tokenizer hands it
+        // back there and would spin on a full ring otherwise.
+        void *item = NULL;
+        CSFM_Ring_tryPop(&pipeline->free_blocks, &item);
+        CSFM_PipelineBlock *block = item;
+        block->length = 0;
+        block->last = true;
+        block->failed = true;
+        CSFM_Ring_tryPush(&pipeline->full_blocks, block);
+    }
+
+    CSFM_Context context;
+    CSFM_Context_init(&context);
+    result.error = CSFM_NodeArray_allocate(&result.tree, CSFM_CONTEXT_MIN_CAPACITY);
+    CSFM_ParseState state;
+    CSFM_ParseState_begin(&state, &result, options, &context);
+    uint64_t waited = 0;
+    bool last = false;
+    while (!last) {
+        CSFM_PipelineBatch *batch = CSFM_Ring_pop(&pipeline->full_batches, &waited);
+        last = batch->last;
+        if (result.error == CSFM_ERROR_SUCCESS) {
+            result.error = batch->error;
+        }
+        if (result.error == CSFM_ERROR_SUCCESS) {
+            // NOTE(mattg): The document may have moved since the last batch.
+            result.input.ptr = batch->document;
+            result.input.length = batch->start + batch->length;
+            // NOTE(mattg): An empty document still gets its NULL node, like
+            // it does from CSFM_Parse.
+            if (batch->length > 0 || (last && result.input.length == 0)) {
+                CSFM_TokenSource source = {
+                    .input = result.input,
+                    .tokens = batch->tokens,
+                    .count = batch->token_count,
+                };
+                CSFM_TRACE_BEGIN(build_tree);
+                CSFM_ParseState_run(&state, &result, &source, result.input.length);
+                CSFM_TRACE_END(build_tree, NULL, batch->length);
+            }
+        }
+        CSFM_Ring_push(&pipeline->free_batches, batch, &waited);
+    }
+    // NOTE(mattg): The tokenizer is done with the document once it has sent
+    // the last batch.
+    result.input.ptr = pipeline->document;
+    result.input.length = pipeline->document_length;
+    CSFM_ParseState_finish(&state, &result);
+    CSFM_Context_deallocate(&context);
+    pipeline->stats.wait_ns[CSFM_STAGE_PARSER] = waited;
+    pipeline->stats.busy_ns[CSFM_STAGE_PARSER] = CSFM_nanoseconds() - start - waited;
+
+    pthread_join(tokenizer, NULL);
+    if (readerStarted) {
+        pthread_join(reader, NULL);
+    }
+    pipeline->stats.wall_ns = CSFM_nanoseconds() - start;
+    if (stats != NULL) {
+        *stats = pipeline->stats;
+    }
+    for (uint32_t i = 0; i < CSFM_PIPELINE_DEPTH; i++) {
+        free(pipeline->batches[i].tokens);
+    }
+    free(pipeline->blocks);
+    free(pipeline);
+    CSFM_TRACE_END(parse, NULL, result.input.length);
+    return result;
+}
+#endif
+
+#if defined(CSFM_TRACE)
+#define CSFM_TRACE_CHUNK_LENGTH 1024
+
+// NOTE(mattg): Chunks are never moved or freed, so CSFM_Trace_write can walk
+// them while their thread keeps appending. `count` and `next` are published
+// with release stores after the event itself is written.
+typedef struct CSFM_TraceChunk {
+    CSFM_TraceEvent events[CSFM_TRACE_CHUNK_LENGTH];
+    uint32_t count;
+    struct CSFM_TraceChunk *next;
+} CSFM_TraceChunk;
+
+typedef struct CSFM_TraceBuffer {
+    uint32_t thread_id;
+    const char *thread_name;
+    CSFM_TraceChunk *first;
+    CSFM_TraceChunk *last;
+    struct CSFM_TraceBuffer *next;
+} CSFM_TraceBuffer;
+
+// Every thread that has recorded something, newest first.
+static CSFM_TraceBuffer *CSFM_traceBuffers = NULL;
+static uint32_t CSFM_traceThreads = 0;
+static __thread CSFM_TraceBuffer *CSFM_traceBuffer = NULL;
+
+uint64_t CSFM_Trace_now(void) {
+    return CSFM_nanoseconds();
+}
+
+// The calling thread's buffer, registered on first use. NULL when out of
+// memory, the event is then dropped.
+static CSFM_TraceBuffer *CSFM_TraceBuffer_local(void) {
+    if (CSFM_traceBuffer != NULL) {
+        return CSFM_traceBuffer;
+    }
+    CSFM_TraceBuffer *buffer = calloc(1, sizeof(CSFM_TraceBuffer));
+    if (buffer == NULL) {
+        return NULL;
+    }
+    buffer->thread_id = __atomic_add_fetch(&CSFM_traceThreads, 1, __ATOMIC_RELAXED);
+    buffer->next = __atomic_load_n(&CSFM_traceBuffers, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(
+        &CSFM_traceBuffers, &buffer->next, buffer, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED
+    )) {
+    }
+    CSFM_traceBuffer = buffer;
+    return buffer;
+}
+
+void CSFM_Trace_record(const char *name, uint64_t start, const char *file, uint64_t bytes) {
+    uint64_t end = CSFM_nanoseconds();
+    CSFM_TraceBuffer *buffer = CSFM_TraceBuffer_local();
+    if (buffer == NULL) {
+        return;
+    }
+    CSFM_TraceChunk *chunk = buffer->last;
+    if (chunk == NULL || chunk->count == CSFM_TRACE_CHUNK_LENGTH) {
+        CSFM_TraceChunk *fresh = calloc(1, sizeof(CSFM_TraceChunk));
+        if (fresh == NULL) {
+            return;
+        }
+        __atomic_store_n(chunk == NULL ? &buffer->first : &chunk->next, fresh, __ATOMIC_RELEASE);
+        buffer->last = chunk = fresh;
+    }
+    CSFM_TraceEvent event = {
+        .name = name,
+        .file = file,
+        .bytes = bytes,
+        .start_ns = start,
+        .end_ns = end,
+    };
+    chunk->events[chunk->count] = event;
+    __atomic_store_n(&chunk->count, chunk->count + 1, __ATOMIC_RELEASE);
+}
+
+void CSFM_Trace_nameThread(const char *name) {
+    CSFM_TraceBuffer *buffer = CSFM_TraceBuffer_local();
+    if (buffer != NULL) {
+        __atomic_store_n(&buffer->thread_name, name, __ATOMIC_RELEASE);
+    }
+}
+
+static void CSFM_Trace_writeString(FILE *file, const char *string) {
+    fputc('"', file);
+    for (const uint8_t *c = (const uint8_t *)string; *c != '\0'; c++) {
+        if (*c == '"' || *c == '\\') {
+            fputc('\\', file);
+            fputc(*c, file);
+        } else if (*c < 0x20) {
+            fprintf(file, "\\u%04x", *c);
+        } else {
+            fputc(*c, file);
+        }
+    }
+    fputc('"', file);
+}
+
+// NOTE(mattg): Trace timestamps are microseconds, keep the nanoseconds as
+// the fraction rather than going through a double.
+static void CSFM_Trace_writeMicroseconds(FILE *file, uint64_t nanoseconds) {
+    fprintf(file, "%llu.%03u", (unsigned long long)(nanoseconds / 1000), (unsigned)(nanoseconds % 1000));
+}
+
+CSFM_ErrorType CSFM_Trace_write(FILE *file) {
+    if (file == NULL) {
+        return CSFM_ERROR_IO;
+    }
+    fputs("{\"traceEvents\":[", file);
+    const char *separator = "\n";
+    CSFM_TraceBuffer *buffer = __atomic_load_n(&CSFM_traceBuffers, __ATOMIC_ACQUIRE);
+    for (; buffer != NULL; buffer = buffer->next) {
+        const char *threadName = __atomic_load_n(&buffer->thread_name, __ATOMIC_ACQUIRE);
+        if (threadName != NULL) {
+            fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":", separator, buffer->thread_id);
+            CSFM_Trace_writeString(file, threadName);
+            fputs("}}", file);
+            separator = ",\n";
+        }
+        CSFM_TraceChunk *chunk = __atomic_load_n(&buffer->first, __ATOMIC_ACQUIRE);
+        for (; chunk != NULL; chunk = __atomic_load_n(&chunk->next, __ATOMIC_ACQUIRE)) {
+            uint32_t count = __atomic_load_n(&chunk->count, __ATOMIC_ACQUIRE);
+            for (uint32_t i = 0; i < count; i++) {
+                const CSFM_TraceEvent *event = &chunk->events[i];
+                fprintf(file, "%s{\"name\":", separator);
+                CSFM_Trace_writeString(file, event->name);
+                fprintf(file, ",\"cat\":\"csfm\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":", buffer->thread_id);
+                CSFM_Trace_writeMicroseconds(file, event->start_ns);
+                fputs(",\"dur\":", file);
+                CSFM_Trace_writeMicroseconds(file, event->end_ns - event->start_ns);
+                fputs(",\"args\":{", file);
+                if (event->file != NULL) {
+                    fputs("\"file\":", file);
+                    CSFM_Trace_writeString(file, event->file);
+                    fputc(',', file);
+                }
+                fprintf(file, "\"bytes\":%llu}}", (unsigned long long)event->bytes);
+                separator = ",\n";
+            }
+        }
+    }
+    fputs("\n]}\n", file);
+    return ferror(file) != 0 ? CSFM_ERROR_IO : CSFM_ERROR_SUCCESS;
 }
+#endif
 
 #endif // CSFM_IMPLEMENTATION
@@ -1,6 +1,6 @@
 #!/usr/bin/env bash
 
-gcc -O0 -std=c99 \
+gcc -O0 -std=c99 -pthread -DCSFM_THREADS \
     -Wall -Wextra -pedantic \
     -fsanitize=address -fsanitize=undefined \
     -o csfm main.c
@@ -5,8 +5,12 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
 #include <x86intrin.h>
+#define HAS_RDTSC 1
+#endif
 
 #define CSFM_IMPLEMENTATION
 #include "csfm.h"
@@ -16,8 +20,27 @@ typedef struct {
     struct timespec time;
 } Timer;
 
+#ifdef HAS_RDTSC
+#define CYCLE_UNIT "cycles"
+#else
+// NOTE(mattg): No portable cycle counter, count monotonic nanoseconds instead.
+#define CYCLE_UNIT "ticks"
+#endif
+
+long readCycleCounter(void) {
+#ifdef HAS_RDTSC
+    return (long)__rdtsc();
+#else
+    struct timespec now = {0};
+    if (clock_gettime(CLOCK_MONOTONIC, &now) != 0) {
+        exit(1);
+    }
+    return (now.tv_sec * (long)1e9) + now.tv_nsec;
+#endif
+}
+
 void getTime(Timer *timer) {
-    timer->cycles = __rdtsc();
+    timer->cycles = readCycleCounter();
     if (clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &timer->time) != 0) {
         exit(1);
     }
@@ -31,20 +54,84 @@ void printTimeData(Timer start, Timer end, size_t size) {
         end.time.tv_nsec - start.time.tv_nsec
     );
     float nanosPerByte = (float)nanoseconds / (float)size;
-    printf("%ld bytes, %ld cycles, %ld ns\n", size, cycles, nanoseconds);
-    printf("%.2f cycles/byte, %.2f ns/byte\n", cyclesPerByte, nanosPerByte);
+    printf("%ld bytes, %ld " CYCLE_UNIT ", %ld ns\n", size, cycles, nanoseconds);
+    printf("%.2f " CYCLE_UNIT "/byte, %.2f ns/byte\n", cyclesPerByte, nanosPerByte);
 }
 
-int main(void) {
-    const char *path = "/home/mgetgen/repos/usfm/simdusfm/src/usfm/HPUX.usfm";
-    // const char *path = "/home/mgetgen/repos/usfm/example_usfm/HPUX/01GENHPUX.SFM";
-    // const char *path = "/home/mgetgen/repos/usfm/example_usfm/WEB/25-JEReng-web.usfm";
-    // const char *path = "./test.usfm";
+#ifdef CSFM_THREADS
+static const char *STAGE_NAMES[CSFM_STAGE_COUNT] = {
+    [CSFM_STAGE_READER] = "reader",
+    [CSFM_STAGE_TOKENIZER] = "tokenizer",
+    [CSFM_STAGE_PARSER] = "parser",
+};
+
+// Parses `path` (or stdin when NULL) through the threaded pipeline and
+// reports how busy each stage was, the busiest one limits throughput.
+int runPipeline(const char *path) {
+    FILE *file = path != NULL ? fopen(path, "rb") : stdin;
+    if (file == NULL) {
+        printf("Error: `fopen` failed\n");
+        return 1;
+    }
+
+    printf("Pipelined parse:\n");
+    CSFM_TRACE_BEGIN(file);
+    CSFM_PipelineStats stats = {0};
+    CSFM_Options options = { .flags = CSFM_OPTION_NONE };
+    CSFM_ParseResult parseResult = CSFM_Pipeline_parse(file, options, &stats);
+    if (path != NULL) {
+        fclose(file);
+    }
+    CSFM_TRACE_END(file, path != NULL ? path : "<stdin>", parseResult.input.length);
+    if (parseResult.error != CSFM_ERROR_SUCCESS) {
+        printf("Error: `CSFM_Pipeline_parse` failed (%d)\n", parseResult.error);
+        return 1;
+    }
+
+    double seconds = (double)stats.wall_ns / 1e9;
+    printf("\n# nodes: %d, # blocks: %d, # batches: %d\n", parseResult.tree.length, stats.blocks, stats.batches);
+    printf(
+        "%u bytes, %ld ns, %.2f MB/s\n",
+        parseResult.input.length, (long)stats.wall_ns, (double)parseResult.input.length / 1e6 / seconds
+    );
+    for (uint32_t stage = 0; stage < CSFM_STAGE_COUNT; stage++) {
+        printf(
+            "%-10s busy %10ld ns, waiting %10ld ns, %5.1f%% utilized\n",
+            STAGE_NAMES[stage], (long)stats.busy_ns[stage], (long)stats.wait_ns[stage],
+            100.0 * (double)stats.busy_ns[stage] / (double)stats.wall_ns
+        );
+    }
+
+    free(parseResult.input.ptr);
+    CSFM_ParseResult_deallocate(&parseResult);
+    return 0;
+}
+#endif
+
+#ifdef CSFM_TRACE
+int writeTrace(const char *path) {
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        printf("Error: `fopen` failed\n");
+        return 1;
+    }
+    CSFM_ErrorType error = CSFM_Trace_write(file);
+    if (fclose(file) != 0 || error != CSFM_ERROR_SUCCESS) {
+        printf("Error: `CSFM_Trace_write` failed\n");
+        return 1;
+    }
+    printf("\nWrote trace to %s\n", path);
+    return 0;
+}
+#endif
 
+int runBenchmark(const char *path) {
     printf("Reading file:\n");
+    CSFM_TRACE_BEGIN(file);
     Timer start = {0};
     Timer end = {0};
     getTime(&start);
+    CSFM_TRACE_BEGIN(load);
     // TODO(matt): test if we can get consistent performance from O_DIRECT
     // (minimizes OS caching, check man 2 open)
     int fd = open(path, O_RDONLY);
@@ -70,8 +157,29 @@ int main(void) {
         printf("Error: `read` failed\n");
         return 1;
     }
+    CSFM_TRACE_END(load, path, size);
     getTime(&end);
     printTimeData(start, end, size);
+
+    uint32_t bomLength = 0;
+    CSFM_Encoding encoding = CSFM_Encoding_detect((uint8_t *)filebuf, size, &bomLength);
+    if (encoding != CSFM_ENCODING_UTF8 || bomLength != 0) {
+        printf("\nTranscoding file:\n");
+        getTime(&start);
+
+        CSFM_String8Slice transcoded = {0};
+        if (CSFM_TranscodeToUTF8((uint8_t *)filebuf, size, encoding, &transcoded, NULL) != CSFM_ERROR_SUCCESS) {
+            printf("Error: `CSFM_TranscodeToUTF8` failed\n");
+            return 1;
+        }
+
+        getTime(&end);
+        printTimeData(start, end, size);
+
+        free(filebuf);
+        filebuf = transcoded.ptr;
+        size = transcoded.length;
+    }
     
     printf("\nTokenizing file:\n");
     getTime(&start);
@@ -112,7 +220,26 @@ int main(void) {
         tokensPerByte, nodesPerByte, nodesPerToken
     );
 
-    CSFM_NodeArray_deallocate(&parseResult.tree);
+    printf("\nOpening first chapter lazily:\n");
+    getTime(&start);
+    CSFM_TRACE_BEGIN(lazy_open);
+
+    CSFM_LazyDocument lazy = {0};
+    CSFM_Options lazyOptions = { .flags = CSFM_OPTION_NONE };
+    if (CSFM_LazyDocument_open(&lazy, (uint8_t *)filebuf, size, lazyOptions, 4) != CSFM_ERROR_SUCCESS) {
+        printf("Error: `CSFM_LazyDocument_open` failed\n");
+        return 1;
+    }
+    const CSFM_ParseResult *firstChapter = CSFM_LazyDocument_chapter(&lazy, lazy.chapter_count > 1 ? 1 : 0);
+    CSFM_TRACE_END(lazy_open, path, size);
+
+    getTime(&end);
+
+    printf("\n# chapters: %d, # nodes: %d\n", lazy.chapter_count, firstChapter->tree.length);
+    printTimeData(start, end, size);
+    CSFM_LazyDocument_deallocate(&lazy);
+
+    CSFM_ParseResult_deallocate(&parseResult);
     CSFM_TokenArray_deallocate(&tokenResult.tokens);
     free(filebuf);
 
@@ -120,5 +247,48 @@ int main(void) {
         printf("Error: `close` failed\n");
         return 1;
     }
+    CSFM_TRACE_END(file, path, size);
     return 0;
 }
+
+int main(int argc, char **argv) {
+    CSFM_TRACE_THREAD("main");
+    // NOTE(mattg): `--trace out.json` has to come first, the timeline can be
+    // opened in chrome://tracing or ui.perfetto.dev.
+#ifdef CSFM_TRACE
+    const char *tracePath = NULL;
+#endif
+    int arg = 1;
+    if (arg + 1 < argc && strcmp(argv[arg], "--trace") == 0) {
+#ifdef CSFM_TRACE
+        tracePath = argv[arg + 1];
+        arg += 2;
+#else
+        printf("Error: built without CSFM_TRACE\n");
+        return 1;
+#endif
+    }
+
+    int status = 0;
+    if (arg < argc && strcmp(argv[arg], "--pipeline") == 0) {
+#ifdef CSFM_THREADS
+        status = runPipeline(arg + 1 < argc ? argv[arg + 1] : NULL);
+#else
+        printf("Error: built without CSFM_THREADS\n");
+        return 1;
+#endif
+    } else {
+        const char *path = "/home/mgetgen/repos/usfm/simdusfm/src/usfm/HPUX.usfm";
+        // const char *path = "/home/mgetgen/repos/usfm/example_usfm/HPUX/01GENHPUX.SFM";
+        // const char *path = "/home/mgetgen/repos/usfm/example_usfm/WEB/25-JEReng-web.usfm";
+        // const char *path = "./test.usfm";
+        status = runBenchmark(arg < argc ? argv[arg] : path);
+    }
+
+#ifdef CSFM_TRACE
+    if (tracePath != NULL && writeTrace(tracePath) != 0) {
+        return 1;
+    }
+#endif
+    return status;
+}
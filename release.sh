@@ -1,5 +1,5 @@
 #!/usr/bin/env bash
 
-gcc -O3 -std=c99 \
+gcc -O3 -std=c99 -pthread -DCSFM_THREADS \
     -Werror -Wall -Wextra -pedantic \
     -o csfm main.c
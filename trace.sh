@@ -0,0 +1,5 @@
+#!/usr/bin/env bash
+
+gcc -O3 -std=c99 -pthread -DCSFM_THREADS -DCSFM_TRACE \
+    -Werror -Wall -Wextra -pedantic \
+    -o csfm main.c